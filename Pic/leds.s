@@ -1,7 +1,6 @@
 #include <xc.inc>
 
 
-#define NUM_LEDS 27
 #define LED_PIN 2			;**********
 
 ; WS2812B timings in ns:
@@ -17,7 +16,7 @@
 #define T1L 5		; 5.4
 
 
-GLOBAL _cnt, _red, _green, _blue, _Ticks
+GLOBAL _cnt, _red, _green, _blue, _Ticks, _NumLeds
 
 GLOBAL _reset_leds
 SIGNAT _reset_leds,4217
@@ -107,8 +106,9 @@ _test_leds:
 test:
 		call _reset_leds
 
+		BANKSEL (_NumLeds)				; strip length is a setting
+		movf BANKMASK(_NumLeds),w
 		BANKSEL (_cnt)
-		movlw NUM_LEDS
 		movwf BANKMASK(_cnt)
 
 test1:	call _set_led
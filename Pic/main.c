@@ -13,24 +13,82 @@
 
 
 extern void reset_leds(void);
-extern void test_leds(void);
 extern void InitTuring(void);
 extern void TuringExec(void);
+extern bool TuringWaiting(void);
+extern bool TuringHalted(void);
+extern void StoreExec(void);
+extern void DisplayExec(void);
 extern void ProcessCommand(uint8_t*, uint8_t);
+extern void NextSlot(void);
 
+void schedule(void);
+void run_task(uint8_t task);
 void init_timer(void);
+void meter_idle(void);
+void sleep_core(void);
+void LED_FlashTask(void);
+bool BUTTON_IsPressed(void);
+bool APP_ButtonTasks(void);
 void APP_DeviceCDCEmulatorTasks(void);
+void send_replies(void);
 
 
 // ms counter
 uint16_t Ticks = 0;
 
-// auto run flag
-bool auto_run = false;
+// main loop passes in the last second
+uint16_t LoopRate = 0;
 
-// static uint8_t USB_Out_Buffer[CDC_DATA_OUT_EP_SIZE];
+// main loop pass counter
+uint16_t LoopCnt = 0;
+
+// milliseconds the core waited for an interrupt in the last second and the idle cycles at the start of it
+uint16_t IdleRate = 0;
+uint32_t IdleCycles = 0;
+
+// times the core has gone to sleep
+uint16_t Sleeps = 0;
+
+// set by every interrupt
+volatile bool Woken = false;
+
+// true while a button change settles
+bool Settling = false;
+
+// status LED flashes still to show, counted in halves (on, then off), and the tick the current half started
+uint8_t LedFlashes = 0;
+uint16_t LedFlashTicks;
+
+// the main loop's tasks, run cooperatively with the nearest deadline first
+enum {TASK_COMMANDS, TASK_STEPS, TASK_DISPLAY, TASK_STORE, TASK_TELEMETRY, NUM_TASKS};
+
+typedef struct
+{
+	uint16_t Period;	// ticks between releases, 0 for every pass of the main loop
+	uint16_t Deadline;	// ticks after its release the task should have started by
+	uint16_t Release;	// tick of the current release
+	uint16_t Missed;	// starts later than the deadline
+	uint8_t Late;		// worst lateness in ticks
+	uint8_t Longest;	// longest run in ticks
+}
+TASK;
+
+TASK Tasks[NUM_TASKS] =
+{
+	{0, 1},		// host commands and the button, USB wants attention every millisecond
+	{0, 1},		// machine steps, timed in ticks
+	{0, 20},	// LED frame output, 50 frames a second at the least
+	{0, 10},	// background flash store
+	{1000, 10}	// loop and idle rates
+};
+
+static uint8_t USB_Out_Buffer[CDC_DATA_OUT_EP_SIZE];
 static uint8_t USB_In_Buffer[CDC_DATA_IN_EP_SIZE];
 
+// bytes of replies queued in USB_Out_Buffer for the command task to send
+static uint8_t ReplyPending = 0;
+
 
 // main program entry point
 MAIN_RETURN main(void)
@@ -39,13 +97,21 @@ MAIN_RETURN main(void)
 
 	init_timer();
 
-	test_leds();
+	// shows the self test or starts the stored program
+	InitTuring();
 
 	USBDeviceInit();
 	USBDeviceAttach();
 
+	// the tasks are first released now, the start up may have taken a while
+	uint16_t now = get_ticks();
+	for (uint8_t i = 0; i < NUM_TASKS; i++) Tasks[i].Release = now + Tasks[i].Period;
+
 	while (true)
 	{
+		// an interrupt from here on means there may be more to do
+		Woken = false;
+
 		SYSTEM_Tasks();
 
 		#if defined(USB_POLLING)
@@ -73,19 +139,162 @@ MAIN_RETURN main(void)
 		 * issue a remote wakeup. In either case, we shouldn't process any
 		 * keyboard commands since we aren't currently communicating to the host
 		 * thus just continue back to the start of the while loop. */
-		// if (USBIsDeviceSuspended()) continue;
+		if (USBIsDeviceSuspended())
+		{
+			#if defined(USB_INTERRUPT)
+			sleep_core();
+			#endif
+			continue;
+		}
 
 		// application specific tasks
-		APP_DeviceCDCEmulatorTasks();
+		schedule();
+
+		LoopCnt++;
+
+		// nothing to do until an interrupt, sleep if the tick isn't needed and no host is using the bus
+		if (Settling) continue;
+		#if defined(USB_INTERRUPT)
+		if (TuringHalted() && LedFlashes == 0 && USBGetDeviceState() < DEFAULT_STATE)
+		{
+			sleep_core();
+			continue;
+		}
+		#endif
+		if (TuringWaiting()) meter_idle();
+	}
+}
+
+
+// runs each task that has been released once, the one with the nearest deadline first, so a slow task
+// (a flash write, a long step) holds up the most urgent task next rather than the next in a fixed order
+void schedule(void)
+{
+	uint8_t ran = 0;
+
+	while (true)
+	{
+		// the tick count is read once a pass, the interrupt can change it between its bytes
+		uint16_t now = get_ticks();
+		uint8_t next = NUM_TASKS;
+		int16_t nearest = 0;
 
-		if (!auto_run)
+		for (uint8_t i = 0; i < NUM_TASKS; i++)
 		{
-			auto_run = true;
-			InitTuring();
+			TASK* task = &Tasks[i];
+			if ((ran & (1 << i)) || (int16_t) (now - task->Release) < 0) continue;
+
+			int16_t left = (int16_t) (task->Release + task->Deadline - now);
+			if (next == NUM_TASKS || left < nearest) next = i, nearest = left;
 		}
+		if (next == NUM_TASKS) return;
+		ran |= 1 << next;
+
+		TASK* task = &Tasks[next];
+		if (nearest < 0)
+		{
+			task->Missed++;
+			if (-nearest > task->Late) task->Late = -nearest > 0xff ? 0xff : (uint8_t) -nearest;
+		}
+
+		run_task(next);
+		uint16_t end = get_ticks();
+		uint16_t time = end - now;
+		if (time > task->Longest) task->Longest = time > 0xff ? 0xff : (uint8_t) time;
+
+		// a task run every pass is wanted again straight away, a periodic one that fell a period behind starts afresh
+		if (task->Period == 0) task->Release = end;
+		else
+		{
+			task->Release += task->Period;
+			if ((int16_t) (end - task->Release) >= (int16_t) task->Period) task->Release = end;
+		}
+	}
+}
 
+// runs a task
+void run_task(uint8_t task)
+{
+	switch (task)
+	{
+	case TASK_COMMANDS:
+		APP_DeviceCDCEmulatorTasks();
+		Settling = APP_ButtonTasks();
+		break;
+
+	case TASK_STEPS:
+		CPU_Account(CPU_INTERPRETER);
 		TuringExec();
+		CPU_Account(CPU_OTHER);
+		break;
+
+	case TASK_DISPLAY:
+		DisplayExec();
+		LED_FlashTask();
+		break;
+
+	case TASK_STORE:
+		// a row at a time
+		StoreExec();
+		break;
+
+	case TASK_TELEMETRY:
+		{
+			LoopRate = LoopCnt;
+			LoopCnt = 0;
+			uint32_t idle = CPU_Cycles(CPU_IDLE);
+			IdleRate = (uint16_t) ((idle - IdleCycles) / TICK_CYCLES);
+			IdleCycles = idle;
+		}
+		break;
+	}
+}
+
+// copies the task deadline stats to a buffer (missed deadlines, little endian, the worst lateness and the longest
+// run in ticks) and starts them afresh, returns the number of tasks
+uint8_t TaskStats(uint8_t* buffer)
+{
+	for (uint8_t i = 0; i < NUM_TASKS; i++)
+	{
+		TASK* task = &Tasks[i];
+		*buffer++ = (uint8_t) task->Missed;
+		*buffer++ = (uint8_t) (task->Missed >> 8);
+		*buffer++ = task->Late;
+		*buffer++ = task->Longest;
+		task->Missed = 0;
+		task->Late = task->Longest = 0;
+	}
+	return NUM_TASKS;
+}
+
+
+// spins until the next interrupt (the tick at the latest) so the cycles spent waiting are charged as idle time,
+// which is all IdleRate measures: the core can't doze here, it has no idle mode and the tick stops in sleep
+void meter_idle(void)
+{
+	uint8_t bucket = CPU_Account(CPU_IDLE);
+
+	while (!Woken) ;
+
+	CPU_Account(bucket);
+}
+
+// sleeps until bus activity or the button wakes the core, the tick stops with the instruction clock
+void sleep_core(void)
+{
+	// a host turning up wakes us too, and the regulator drops to low power while asleep
+	UIEbits.ACTVIE = 1;
+	VREGCONbits.VREGPM = 1;
+
+	// an interrupt since the start of the pass may have left something to do
+	INTCONbits.GIE = 0;
+	if (!Woken)
+	{
+		Sleeps++;
+		SLEEP();
+		NOP();
 	}
+	INTCONbits.GIE = 1;
 }
 
 
@@ -104,6 +313,9 @@ void init_timer(void)
 	INTCONbits.PEIE = 1;
 
 	T1CONbits.TMR1ON = 1;
+
+	// the tick counts from here on, so the start up is timed too (USB interrupts stay masked until USBDeviceInit)
+	INTCONbits.GIE = 1;
 }
 
 
@@ -122,6 +334,33 @@ void BUTTON_Enable(void)
 	S1_WPU = 1;
 	OPTION_REGbits.nWPUEN = 0;
 	S1_TRIS = 1;
+
+	// either edge wakes the core
+	IOCAPbits.IOCAP5 = 1;
+	IOCANbits.IOCAN5 = 1;
+	IOCAFbits.IOCAF5 = 0;
+	INTCONbits.IOCIE = 1;
+}
+
+// cycles through the program slots on each press, returns true while a change settles
+bool APP_ButtonTasks(void)
+{
+	#define DEBOUNCE 20
+
+	static bool pressed = false;
+	static uint16_t stable = 0;
+
+	// wait for a change to settle
+	if (BUTTON_IsPressed() == pressed)
+	{
+		stable = get_ticks();
+		return false;
+	}
+	if ((uint16_t) (get_ticks() - stable) < DEBOUNCE) return true;
+
+	pressed = !pressed;
+	if (pressed) NextSlot();
+	return false;
 }
 
 
@@ -150,15 +389,28 @@ void LED_Enable(void)
 	#endif
 }
 
-void LED_Flash(void)
+// milliseconds the status LED spends on, and then off, in a flash
+#define FLASH_TICKS 150
+
+// flashes the status LED, fed with the number of flashes, shown by the display task rather than waited for
+void LED_Flash(uint8_t n)
 {
-	#if defined (LED)
-	#define delay() {for (long int i = 0; i < 100000L; i++) ; __asm("clrwdt");}
+	if (n == 0) return;
+
+	LedFlashes = (uint8_t) (n * 2);
+	LedFlashTicks = get_ticks();
 	LED_On();
-	delay();
-	LED_Off();
-	delay();
-	#endif
+}
+
+// shows the flashes still to show, a half flash at a time
+void LED_FlashTask(void)
+{
+	uint16_t now = get_ticks();
+	if (LedFlashes == 0 || (uint16_t) (now - LedFlashTicks) < FLASH_TICKS) return;
+	LedFlashTicks = now;
+
+	if (--LedFlashes & 1) LED_Off();
+	else if (LedFlashes != 0) LED_On();
 }
 
 
@@ -212,6 +464,9 @@ void APP_DeviceCDCEmulatorInitialize(void)
 	line_coding.bParityType = 0;
 	line_coding.dwDTERate = 19200;
 
+	// replies queued for a host that has gone are dropped
+	ReplyPending = 0;
+
 	// initialize array
 	// for (int i = 0; i < sizeof(USB_Out_Buffer); i++) USB_Out_Buffer[i] = 0;
 }
@@ -223,12 +478,44 @@ void APP_DeviceCDCEmulatorTasks(void)
 
 	if (USBIsDeviceSuspended()) return;
 
+	// the next command waits until the replies to the last have gone, so they have the queue to themselves
+	send_replies();
+	if (ReplyPending != 0) return;
+
 	uint8_t n = getsUSBUSART(USB_In_Buffer, 64);
 	if (n > 0)
 	{
-		// LED_Flash();
+		// LED_Flash(1);
 		ProcessCommand(USB_In_Buffer, n);
 	}
 
-	// CDCTxService();
+	send_replies();
+}
+
+// hands the queued replies to the IN endpoint once it is free
+void send_replies(void)
+{
+	CDCTxService();
+	if (ReplyPending == 0 || !USBUSARTIsTxTrfReady()) return;
+
+	// the stack copies the replies to the endpoint buffer as it starts sending, leaving the queue free
+	putUSBUSART(USB_Out_Buffer, ReplyPending);
+	CDCTxService();
+	ReplyPending = 0;
+}
+
+
+// sends a reply to the host, fed with buffer pointer and character count
+void SendReply(uint8_t* buffer, uint8_t cnt)
+{
+	if (USBGetDeviceState() < CONFIGURED_STATE) return;
+
+	if (USBIsDeviceSuspended()) return;
+
+	// queued behind the replies still waiting for the endpoint, a reply there's no room for is dropped rather than
+	// waited for, as no task may spin
+	if (cnt > sizeof(USB_Out_Buffer) - ReplyPending) return;
+	for (uint8_t i = 0; i < cnt; i++) USB_Out_Buffer[ReplyPending++] = buffer[i];
+
+	send_replies();
 }
@@ -51,6 +51,43 @@
 
 
 extern uint16_t Ticks;
+extern volatile bool Woken;
+
+
+// deepest hardware stack level seen
+uint8_t MaxStackDepth = 0;
+
+// reset flags (PCON) captured at power-up
+uint8_t ResetFlags = 0;
+
+// CPU time accounting, the cycles charged to each bucket (free running) and at the last report, the bucket
+// being charged and the tick count and timer 1 when it was last charged
+uint32_t CpuCycles[CPU_BUCKETS];
+uint32_t CpuReported[CPU_BUCKETS];
+uint8_t CpuBucket = CPU_OTHER;
+uint16_t CpuTicks = 0;
+uint16_t CpuTimer = 0;
+
+// charges the cycles since the bucket was last charged, interrupts must be held off (timer 1 counts up from
+// -TICK_CYCLES to the tick, so the timer difference is signed)
+#define CPU_CHARGE() \
+	{ \
+		uint16_t ticks = Ticks, timer = TMR1; \
+		uint16_t elapsed = ticks - CpuTicks; \
+		if (elapsed == 0) CpuCycles[CpuBucket] += (uint16_t) (timer - CpuTimer); \
+		else CpuCycles[CpuBucket] += (uint32_t) ((int32_t) elapsed * TICK_CYCLES + (int16_t) (timer - CpuTimer)); \
+		CpuTicks = ticks; \
+		CpuTimer = timer; \
+	}
+
+// charges the cycles since the bucket was last charged to the interrupt, then carries on charging the bucket
+#define CPU_CHARGE_INTERRUPT() \
+	{ \
+		uint8_t bucket = CpuBucket; \
+		CpuBucket = CPU_USB; \
+		CPU_CHARGE(); \
+		CpuBucket = bucket; \
+	}
 
 extern void LED_Enable(void);
 extern void BUTTON_Enable(void);
@@ -74,6 +111,10 @@ void SYSTEM_Initialize(SYSTEM_STATE state)
 	switch (state)
 	{
 	case SYSTEM_STATE_USB_START:
+		// remember why we reset (stack overflow, brown-out etc.) then rearm the flags
+		ResetFlags = PCON;
+		PCON = 0x1f;
+
 		#if defined(USE_INTERNAL_OSC)
 		// turn on active clock tuning for USB full speed operation from the INTOSC
 		OSCCON = 0xFC;  // HFINTOSC @ 16MHz, 3X PLL, PLL enabled
@@ -100,19 +141,206 @@ void SYSTEM_Initialize(SYSTEM_STATE state)
 
 void INTERRUPT SYS_InterruptHigh(void)
 {
+	// ends an idle wait or sleep in the main loop
+	Woken = true;
+
+	// charge what was interrupted up to here
+	CPU_CHARGE();
+
 	if (PIR1bits.TMR1IF == 1)
 	{
+		// sample the hardware stack depth (STKPTR is 0x1f when empty)
+		uint8_t depth = (uint8_t) (STKPTR + 1) & 0x1f;
+		if (depth > MaxStackDepth) MaxStackDepth = depth;
+
+		// the tick's own time goes to the interrupt, charged before the tick count and timer move on
+		CPU_CHARGE_INTERRUPT();
+
 		Ticks++;
 
 		// 1ms
-		TMR1 = (unsigned) -12000;
+		TMR1 = (unsigned) -TICK_CYCLES;
+
+		// restart the accounting from the new tick
+		CpuTicks = Ticks;
+		CpuTimer = TMR1;
 
 		PIR1bits.TMR1IF = 0;
 
 		return;
 	}
 
+	#if defined(PROFILER)
+	// sample where a running step has got to, on a timer of its own so the samples fall all through the tick
+	if (PIE1bits.TMR2IE == 1 && PIR1bits.TMR2IF == 1)
+	{
+		if (!Stepping) ProfileIdle++;
+		else
+		{
+			uint16_t ndx = (uint16_t) (ProgramPosition - ProfileStart) >> ProfileShift;
+			if (ndx < PROFILE_BUCKETS) Profile[ndx]++;
+			else ProfileMissed++;
+		}
+
+		PIR1bits.TMR2IF = 0;
+
+		CPU_CHARGE_INTERRUPT();
+
+		return;
+	}
+	#endif
+
+	// the button only has to wake the core, it is read in the main loop
+	if (INTCONbits.IOCIF == 1) IOCAFbits.IOCAF5 = 0;
+
 	#if defined(USB_INTERRUPT)
 	USBDeviceTasks();
 	#endif
+
+	// the rest of the interrupt goes to USB
+	CPU_CHARGE_INTERRUPT();
+}
+
+
+/*********************************************************************
+* Function: uint16_t get_ticks(void)
+*
+* Overview: Returns the millisecond tick count, read until two reads
+*           agree since the tick interrupt can land between its bytes.
+*
+* PreCondition: None
+*
+* Input:  None
+*
+* Output: uint16_t - ticks since power-up (modulo 2^16)
+*
+********************************************************************/
+
+uint16_t get_ticks(void)
+{
+	uint16_t ticks;
+
+	do ticks = Ticks;
+	while (ticks != *(volatile uint16_t*) &Ticks);
+
+	return ticks;
 }
+
+
+/*********************************************************************
+* Function: uint8_t CPU_Account(uint8_t bucket)
+*
+* Overview: Charges the cycles since the last switch to the bucket
+*           being charged, then charges the given bucket from now on.
+*
+* PreCondition: Timer 1 is running, interrupts enabled
+*
+* Input:  uint8_t - the bucket to charge from now on
+*
+* Output: uint8_t - the bucket that was being charged
+*
+********************************************************************/
+
+uint8_t CPU_Account(uint8_t bucket)
+{
+	INTCONbits.GIE = 0;
+	CPU_CHARGE();
+	uint8_t previous = CpuBucket;
+	CpuBucket = bucket;
+	INTCONbits.GIE = 1;
+	return previous;
+}
+
+
+/*********************************************************************
+* Function: uint32_t CPU_Cycles(uint8_t bucket)
+*
+* Overview: Returns the cycles charged to a bucket, a free running count.
+*
+* PreCondition: None
+*
+* Input:  uint8_t - the bucket
+*
+* Output: uint32_t - cycles charged since power-up (modulo 2^32)
+*
+********************************************************************/
+
+uint32_t CPU_Cycles(uint8_t bucket)
+{
+	INTCONbits.GIE = 0;
+	CPU_CHARGE();
+	uint32_t cycles = CpuCycles[bucket];
+	INTCONbits.GIE = 1;
+	return cycles;
+}
+
+
+/*********************************************************************
+* Function: void CPU_Report(uint8_t* percent)
+*
+* Overview: Gives the share of the cycles each bucket has taken since
+*           the last report.
+*
+* PreCondition: None
+*
+* Input:  uint8_t* - where to put CPU_BUCKETS percentages
+*
+* Output: None
+*
+********************************************************************/
+
+void CPU_Report(uint8_t* percent)
+{
+	uint32_t delta[CPU_BUCKETS];
+	uint32_t total = 0;
+
+	INTCONbits.GIE = 0;
+	CPU_CHARGE();
+	for (uint8_t i = 0; i < CPU_BUCKETS; i++)
+	{
+		delta[i] = CpuCycles[i] - CpuReported[i];
+		CpuReported[i] = CpuCycles[i];
+	}
+	INTCONbits.GIE = 1;
+
+	for (uint8_t i = 0; i < CPU_BUCKETS; i++) total += delta[i];
+	// scaled down so the sum times 100 stays in 32 bits (a report a minute apart is 720M cycles)
+	uint8_t shift = 0;
+	while ((total >> shift) > 0xffffffffUL / 100) shift++;
+	total >>= shift;
+	for (uint8_t i = 0; i < CPU_BUCKETS; i++)
+		percent[i] = total == 0 ? 0 : (uint8_t) (((delta[i] >> shift) * 100 + total / 2) / total);
+}
+
+
+#if defined(PROFILER)
+/*********************************************************************
+* Function: void PROFILE_Enable(bool on)
+*
+* Overview: Starts or stops the profiler's sample timer.
+*
+* PreCondition: None
+*
+* Input:  bool - true to start sampling, false to stop
+*
+* Output: None
+*
+********************************************************************/
+
+void PROFILE_Enable(bool on)
+{
+	T2CONbits.TMR2ON = 0;
+	PIE1bits.TMR2IE = 0;
+	PIR1bits.TMR2IF = 0;
+	if (!on) return;
+
+	// 1:64 prescale, no postscale
+	T2CONbits.T2CKPS = 3;
+	T2CONbits.T2OUTPS = 0;
+	PR2 = PROFILE_PERIOD - 1;
+	TMR2 = 0;
+
+	PIE1bits.TMR2IE = 1;
+	T2CONbits.TMR2ON = 1;
+}
+#endif
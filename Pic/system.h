@@ -53,4 +53,131 @@ void SYSTEM_Initialize(SYSTEM_STATE state);
 //void SYSTEM_Tasks(void);
 #define SYSTEM_Tasks()
 
+
+/*** Millisecond Tick ***********************************************/
+
+/*********************************************************************
+* Function: uint16_t get_ticks(void)
+*
+* Overview: Returns the millisecond tick count, read until two reads
+*           agree since the tick interrupt can land between its bytes.
+*
+* PreCondition: None
+*
+* Input:  None
+*
+* Output: uint16_t - ticks since power-up (modulo 2^16)
+*
+********************************************************************/
+uint16_t get_ticks(void);
+
+
+/*** CPU Time Accounting ********************************************/
+
+// instruction cycles a tick (timer 1 is reloaded with -TICK_CYCLES)
+#define TICK_CYCLES 12000
+
+// what the CPU time goes to, the main loop and commands, the interpreter, LED output, flash writes, USB
+// (the interrupt) and waiting for an interrupt
+typedef enum
+{
+    CPU_OTHER,
+    CPU_INTERPRETER,
+    CPU_LEDS,
+    CPU_FLASH,
+    CPU_USB,
+    CPU_IDLE,
+    CPU_BUCKETS
+} CPU_BUCKET;
+
+
+/*********************************************************************
+* Function: uint8_t CPU_Account(uint8_t bucket)
+*
+* Overview: Charges the cycles since the last switch to the bucket
+*           being charged, then charges the given bucket from now on.
+*
+* PreCondition: Timer 1 is running, interrupts enabled
+*
+* Input:  uint8_t - the bucket to charge from now on
+*
+* Output: uint8_t - the bucket that was being charged
+*
+********************************************************************/
+uint8_t CPU_Account(uint8_t bucket);
+
+
+/*********************************************************************
+* Function: uint32_t CPU_Cycles(uint8_t bucket)
+*
+* Overview: Returns the cycles charged to a bucket, a free running count.
+*
+* PreCondition: None
+*
+* Input:  uint8_t - the bucket
+*
+* Output: uint32_t - cycles charged since power-up (modulo 2^32)
+*
+********************************************************************/
+uint32_t CPU_Cycles(uint8_t bucket);
+
+
+/*********************************************************************
+* Function: void CPU_Report(uint8_t* percent)
+*
+* Overview: Gives the share of the cycles each bucket has taken since
+*           the last report.
+*
+* PreCondition: None
+*
+* Input:  uint8_t* - where to put CPU_BUCKETS percentages
+*
+* Output: None
+*
+********************************************************************/
+void CPU_Report(uint8_t* percent);
+
+
+/*** Profiler *******************************************************/
+
+// sampling profiler, its timer only interrupting the interpreter while SET_PROFILE has it on (its counts take
+// some 24 bytes of RAM)
+#define PROFILER
+
+#if defined(PROFILER)
+// profile buckets, a wider bucket shift covering more of the program, and the bucket shift that turns the
+// profiler off
+#define PROFILE_BUCKETS 8
+#define PROFILE_OFF 0xff
+
+// sample timer period in timer 2 counts of 64 cycles, 16064 cycles (about 1.34ms) being no multiple of the tick
+// so the samples fall all through it rather than at the same point in every tick
+#define PROFILE_PERIOD 251
+
+// profiler state kept by the interpreter: the first position profiled, the bucket shift, the bucket counts,
+// the samples outside the buckets and those finding no step running, and whether a step is running
+extern int16_t ProgramPosition;
+extern int16_t ProfileStart;
+extern uint8_t ProfileShift;
+extern uint16_t Profile[PROFILE_BUCKETS];
+extern uint16_t ProfileMissed;
+extern uint16_t ProfileIdle;
+extern bool Stepping;
+
+
+/*********************************************************************
+* Function: void PROFILE_Enable(bool on)
+*
+* Overview: Starts or stops the profiler's sample timer.
+*
+* PreCondition: None
+*
+* Input:  bool - true to start sampling, false to stop
+*
+* Output: None
+*
+********************************************************************/
+void PROFILE_Enable(bool on);
+#endif
+
 #endif
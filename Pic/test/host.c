@@ -0,0 +1,181 @@
+// host test support: registers, emulated flash and stand-ins for the rest of the firmware
+
+#include <stdio.h>
+#include <string.h>
+
+#include <xc.h>
+#include "host.h"
+
+
+//**************************************************************************
+// registers and emulated flash
+//**************************************************************************
+
+volatile uint16_t PMADR, PMDAT, TMR1;
+volatile uint8_t PMDATL, PMDATH, PMCON2;
+volatile PMCON1bits_t PMCON1bits;
+volatile INTCONbits_t INTCONbits;
+
+// program flash, 14 bit words, and the row write latches
+uint16_t Flash[0x2000];
+uint16_t Latches[32];
+
+// carries out a flash read, erase or latch write the firmware has started
+void flash_access(void)
+{
+	uint16_t addr = PMADR & 0x1fff;
+
+	if (PMCON1bits.RD)
+	{
+		PMDATL = (uint8_t) Flash[addr];
+		PMDATH = (uint8_t) (Flash[addr] >> 8);
+		PMCON1bits.RD = 0;
+	}
+
+	if (PMCON1bits.WR)
+	{
+		PMCON1bits.WR = 0;
+
+		if (PMCON1bits.FREE)
+		{
+			for (int i = 0; i < 32; i++) Flash[(addr & ~31) + i] = 0x3fff;
+			PMCON1bits.FREE = 0;
+		}
+		else
+		{
+			// programming can only clear bits
+			Latches[addr & 31] = PMDAT & 0x3fff;
+			if (!PMCON1bits.LWLO) for (int i = 0; i < 32; i++) Flash[(addr & ~31) + i] &= Latches[i], Latches[i] = 0x3fff;
+		}
+	}
+}
+
+
+//**************************************************************************
+// the rest of the firmware
+//**************************************************************************
+
+uint16_t Ticks, LoopRate, IdleRate, Sleeps;
+uint8_t MaxStackDepth, ResetFlags;
+
+void LED_Flash(uint8_t n) { (void) n; }
+void reset_leds(void) {}
+void test_leds(void) {}
+void set_led(void) {}
+
+uint8_t CPU_Account(uint8_t bucket) { (void) bucket; return 0; }
+void CPU_Report(uint8_t* percent) { memset(percent, 0, 6); }
+uint8_t TaskStats(uint8_t* stats) { (void) stats; return 0; }
+void PROFILE_Enable(bool on) { (void) on; }
+uint16_t get_ticks(void) { return Ticks; }
+
+uint8_t Reply[64];
+uint8_t ReplyLen;
+
+void SendReply(uint8_t* buffer, uint8_t cnt)
+{
+	memcpy(Reply, buffer, cnt);
+	ReplyLen = cnt;
+}
+
+
+//**************************************************************************
+// helpers
+//**************************************************************************
+
+static int Failures, Checks;
+
+void power_up(void)
+{
+	for (int i = 0; i < 0x2000; i++) Flash[i] = 0x3fff;
+	InitTuring();
+}
+
+void power_cycle(void)
+{
+	extern int8_t LoadRowIndex;
+	extern bool LoadOpen, LoadChanged, LoadFailed, SlotDirty;
+	extern uint8_t StoreState, NextRow;
+
+	// RAM starts as the firmware initialises it
+	LoadRowIndex = -1;
+	LoadOpen = LoadChanged = LoadFailed = SlotDirty = false;
+	StoreState = 0;
+	NextRow = 0;
+
+	InitTuring();
+}
+
+void command(uint8_t cmd)
+{
+	ProcessCommand(&cmd, 1);
+}
+
+void send_load(const char* prog, int len)
+{
+	uint8_t buffer[64];
+
+	command(RESET);
+
+	// as the host sends it, 63 characters a packet
+	for (int i = 0; i < len; )
+	{
+		int n = len - i < 63 ? len - i : 63;
+		buffer[0] = LOAD;
+		memcpy(buffer + 1, prog + i, n);
+		ProcessCommand(buffer, (uint8_t) (1 + n));
+		i += n;
+	}
+}
+
+void upload(const char* prog, int len)
+{
+	send_load(prog, len);
+	command(RESET);
+}
+
+uint8_t run(const char* prog)
+{
+	upload(prog, (int) strlen(prog));
+	TraceError = 0;
+	command(RUN);
+
+	for (int i = 0; i < 10000 && TimerEnabled; i++) StepTuring();
+	return TraceError;
+}
+
+int read_program(const char* path, char* buf, int size, bool strip)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return -1;
+
+	int len = 0;
+	bool comment = false;
+
+	for (int c; (c = fgetc(f)) != EOF && len < size - 1; )
+	{
+		// the host drops comments and whitespace, a raw upload keeps all but carriage returns
+		if (c == ';' && strip) comment = true;
+		if (strip ? !comment && !(c == ' ' || c == '\t' || c == '\r' || c == '\n') : c != '\r') buf[len++] = (char) c;
+		if (c == '\r' || c == '\n') comment = false;
+	}
+	buf[len] = '\0';
+
+	fclose(f);
+	return len;
+}
+
+void check(bool ok, const char* what)
+{
+	Checks++;
+	if (ok) return;
+
+	Failures++;
+	printf("FAIL: %s\n", what);
+}
+
+int report(const char* name)
+{
+	printf("%s: %d checks, %d failed\n", name, Checks, Failures);
+	return Failures != 0;
+}
@@ -0,0 +1,66 @@
+// host test support: emulated flash, the firmware's entry points and helpers for driving it like the host does
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// commands, as numbered by the firmware
+enum {RESET = 1, LOAD, RUN, STEP, SELECT_SLOT = 11};
+
+// errors, as numbered by the firmware
+enum {ERR_TOO_MANY_NAMES = 4, ERR_STORE_FULL = 7, ERR_NESTING_TOO_DEEP = 8};
+
+// deepest parenthesis nesting in an expression, as set by the firmware
+#define MAX_NESTING 32
+
+// emulated program flash
+extern uint16_t Flash[0x2000];
+
+// last reply the firmware sent
+extern uint8_t Reply[64];
+extern uint8_t ReplyLen;
+
+// firmware entry points and state the tests look at
+extern void InitTuring(void);
+extern void ProcessCommand(uint8_t*, uint8_t);
+extern bool StepTuring(void);
+extern char program_char(int16_t);
+extern uint16_t ProgramLength;
+extern int16_t ProgramPosition;
+extern uint8_t TraceError;
+extern bool TimerEnabled;
+extern void StoreExec(void);
+extern uint16_t Sequence;
+extern uint16_t FlashErases;
+
+// erases the flash and powers up
+void power_up(void);
+
+// powers down and up again on the flash as it was left, dropping the store's state in RAM
+void power_cycle(void);
+
+// sends a command with no arguments
+void command(uint8_t cmd);
+
+// uploads a program in LOAD packets and ends the load, fed with text and length
+void upload(const char* prog, int len);
+
+// sends the packets of a program load without ending it, fed with text and length
+void send_load(const char* prog, int len);
+
+// uploads a program and runs it until it stops or for 10000 steps, fed with text, returns the error it stopped with
+uint8_t run(const char* prog);
+
+// reads a program file, fed with path, buffer, its size and whether to strip it as the host does,
+// returns the length or -1 if unreadable
+int read_program(const char* path, char* buf, int size, bool strip);
+
+// counts test failures, fed with the outcome and a description
+void check(bool ok, const char* what);
+
+// returns the exit status for the tests run, printing a summary
+int report(const char* name);
+
+#endif
@@ -0,0 +1,101 @@
+// loads every example program, as the host strips it and raw, and checks that spelling the interned names back
+// out of flash gives the program sent, and that a name after spaces or a comment gets the same token
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "host.h"
+
+#define EXAMPLES "../../Simulation/examples"
+#define TOKEN_BASE 0x80
+
+static char Text[4096], Spelt[4096];
+
+// returns true for a character of a name
+static bool is_name(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// spells the loaded program back out, each token replaced by the name following its first appearance,
+// returns the length and the number of tokens
+static int spell(int* tokens)
+{
+	int len = 0;
+	*tokens = 0;
+
+	for (int i = 0; i < ProgramLength; i++)
+	{
+		uint8_t c = (uint8_t) program_char(i);
+		if (c < TOKEN_BASE)
+		{
+			Spelt[len++] = (char) c;
+			continue;
+		}
+
+		// a token is spelt out where it first appears, so only later uses need the name copied in
+		int first = 0;
+		while ((uint8_t) program_char(first) != c) first++;
+		if (first == i)
+		{
+			(*tokens)++;
+			continue;
+		}
+
+		for (int j = first + 1; j < ProgramLength && is_name(program_char(j)); j++) Spelt[len++] = program_char(j);
+	}
+
+	return len;
+}
+
+// loads a program and checks it spells back out as sent, returns the number of tokens
+static int round_trip(const char* name, const char* prog, int len)
+{
+	char what[300];
+	int tokens;
+
+	upload(prog, len);
+	int n = spell(&tokens);
+
+	snprintf(what, sizeof(what), "%s spells back as loaded", name);
+	check(n == len && memcmp(Spelt, prog, len) == 0, what);
+
+	return tokens;
+}
+
+int main(void)
+{
+	char what[300], path[300];
+
+	power_up();
+
+	DIR* dir = opendir(EXAMPLES);
+	check(dir != NULL, "examples found");
+
+	for (struct dirent* entry; dir != NULL && (entry = readdir(dir)) != NULL; )
+	{
+		if (strstr(entry->d_name, ".txt") == NULL) continue;
+		snprintf(path, sizeof(path), "%s/%s", EXAMPLES, entry->d_name);
+
+		int len = read_program(path, Text, sizeof(Text), true);
+		int stripped = round_trip(entry->d_name, Text, len);
+
+		len = read_program(path, Text, sizeof(Text), false);
+		int raw = round_trip(entry->d_name, Text, len);
+
+		snprintf(what, sizeof(what), "%s interns the same names raw as stripped", entry->d_name);
+		check(raw == stripped, what);
+	}
+	if (dir != NULL) closedir(dir);
+
+	// the interpreter skips spaces and comments between a sigil and its name
+	const char* spaced = "$count=1 $ count=2 $;note\n count=3 ^ loop";
+	int tokens = round_trip("spaced names", spaced, (int) strlen(spaced));
+
+	int uses = 0;
+	for (int i = 0; i < ProgramLength; i++) if ((uint8_t) program_char(i) == TOKEN_BASE) uses++;
+	check(tokens == 2 && uses == 3, "a name after spaces or a comment uses its token");
+
+	return report("test_load");
+}
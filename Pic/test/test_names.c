@@ -0,0 +1,19 @@
+// fills the name arena with variables and checks that branches to labels that no longer fit still find them,
+// while a new variable is still an error
+
+#include "host.h"
+
+// variables that fill the arena exactly, at 4 bytes each
+#define FILL "$a=1 $b=1 $c=1 $d=1 $e=1 $f=1 $g=1 $h=1 $i=1 $j=1 $k=1 $l=1 " \
+	"$m=1 $n=1 $o=1 $p=1 $q=1 $r=1 $s=1 $t=1 $u=1 $v=1 $w=1 $x=1 "
+
+int main(void)
+{
+	power_up();
+
+	// each branch searches afresh, the second returning to a label behind it
+	check(run(FILL "^on $z=1 #back %0 #on $a=2 ^back") == 0, "labels are found with the arena full");
+	check(run(FILL "$z=1") == ERR_TOO_MANY_NAMES, "a variable that doesn't fit is an error");
+
+	return report("test_names");
+}
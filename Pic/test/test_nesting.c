@@ -0,0 +1,32 @@
+// checks expressions nest as deep as MAX_NESTING and one level deeper stops the machine with ERR_NESTING_TOO_DEEP
+
+#include <stdio.h>
+
+#include "host.h"
+
+static char Prog[200];
+
+// runs an assignment of 1 in parentheses nested to a depth, fed with depth, returns the error it stopped with
+static uint8_t nest(int depth)
+{
+	int len = 0;
+
+	len += sprintf(Prog + len, "$v=");
+	for (int i = 0; i < depth; i++) Prog[len++] = '(';
+	Prog[len++] = '1';
+	for (int i = 0; i < depth; i++) Prog[len++] = ')';
+	len += sprintf(Prog + len, " %%0");
+
+	return run(Prog);
+}
+
+int main(void)
+{
+	power_up();
+
+	check(nest(MAX_NESTING-1) == 0, "nesting one short of the deepest runs");
+	check(nest(MAX_NESTING) == 0, "the deepest nesting runs");
+	check(nest(MAX_NESTING+1) == ERR_NESTING_TOO_DEEP, "nesting past the deepest is an error");
+
+	return report("test_nesting");
+}
@@ -0,0 +1,144 @@
+// checks that the flash store keeps the last committed program across power cycles: after a load cut short, across
+// the sequence numbers wrapping and while a full store reclaims rows for new loads
+
+#include "host.h"
+
+// fills a buffer with a program of a given length told apart by a seed, fed with buffer, length and seed
+static void make_program(char* buf, int len, int seed)
+{
+	for (int i = 0; i < len; i++) buf[i] = (char) ('a' + (i * 7 + seed) % 26);
+	buf[len] = '\0';
+}
+
+// returns whether the active slot holds a program, fed with text and length
+static bool holds(const char* prog, int len)
+{
+	if (ProgramLength != len) return false;
+	for (int i = 0; i < len; i++) if (program_char(i) != prog[i]) return false;
+	return true;
+}
+
+// selects a program slot
+static void select_slot(uint8_t slot)
+{
+	uint8_t buffer[2] = {SELECT_SLOT, slot};
+	ProcessCommand(buffer, 2);
+}
+
+// uploads programs with a power cycle after each, starting from a sequence number, returns whether each survived
+static bool uploads_survive(uint16_t sequence, int count)
+{
+	char prog[200];
+	bool ok = true;
+
+	power_up();
+	Sequence = sequence;
+
+	for (int i = 0; i < count; i++)
+	{
+		int len = 40 + (i * 37) % 150;
+		make_program(prog, len, i);
+		upload(prog, len);
+		power_cycle();
+		ok = ok && holds(prog, len);
+	}
+
+	return ok;
+}
+
+int main(void)
+{
+	char first[300], second[300];
+	make_program(first, 100, 1);
+	make_program(second, 250, 2);
+
+	// a load is committed with the directory, and only then
+	power_up();
+	upload(first, 100);
+	power_cycle();
+	check(holds(first, 100), "an ended load is there after a power cycle");
+
+	send_load(second, 250);
+	power_cycle();
+	check(holds(first, 100), "a load cut short leaves the last committed program");
+
+	send_load(second, 250);
+	power_cycle();
+	send_load(second, 120);
+	power_cycle();
+	check(holds(first, 100), "rows left by loads cut short don't join the program");
+
+	upload(second, 250);
+	power_cycle();
+	check(holds(second, 250), "a load after a load cut short is committed");
+
+	upload(first, 100);
+	power_cycle();
+	check(holds(first, 100), "a shorter program doesn't pick up the rows of a longer one");
+
+	// sequence numbers are compared by their difference, so the newest copy wins wherever they wrap
+	check(uploads_survive(0xffe0, 60), "uploads survive the sequence numbers wrapping");
+	check(uploads_survive(0x7fe0, 60), "uploads survive the sequence numbers changing sign");
+
+	// newer rows at the start of the store and older ones after them, either side of the sign change
+	power_up();
+	Sequence = 0x7f00;
+	upload(second, 250);
+	upload(first, 30);
+	for (int i = 0; i < 100; i++) StoreExec();
+	select_slot(1);
+	upload(first, 100);
+	power_cycle();
+	select_slot(0);
+	Sequence = 0x80f0;
+	upload(second, 100);
+	power_cycle();
+	select_slot(0);
+	upload(first, 100);
+	power_cycle();
+	select_slot(0);
+	check(holds(first, 100), "the newest rows are found whatever order they are in");
+
+	// every slot holding a long program leaves the store full, so each new load has to reclaim rows
+	power_up();
+	char progs[8][200];
+	int lens[8];
+	bool full_ok = true;
+
+	for (int round = 0; round < 6; round++)
+	{
+		for (uint8_t slot = 0; slot < 8; slot++)
+		{
+			lens[slot] = 60 + (round * 23 + slot * 29) % 70;
+			make_program(progs[slot], lens[slot], round * 8 + slot);
+			select_slot(slot);
+			TraceError = 0;
+			upload(progs[slot], lens[slot]);
+			full_ok = full_ok && TraceError != ERR_STORE_FULL && holds(progs[slot], lens[slot]);
+		}
+	}
+	check(full_ok, "loads reclaim rows from a full store");
+
+	bool slots_ok = true;
+	for (uint8_t slot = 0; slot < 8; slot++)
+	{
+		power_cycle();
+		select_slot(slot);
+		slots_ok = slots_ok && holds(progs[slot], lens[slot]);
+	}
+	check(slots_ok, "every slot is there after a power cycle");
+
+	// rows a load replaced are erased in the background once the store is idle
+	select_slot(7);
+	upload(second, 60);
+	uint16_t erases = FlashErases;
+	for (int i = 0; i < 100; i++) StoreExec();
+	check(FlashErases != erases, "the background erases rows no longer needed");
+
+	upload(first, 100);
+	power_cycle();
+	select_slot(7);
+	check(holds(first, 100), "a load after the background erases is committed");
+
+	return report("test_store");
+}
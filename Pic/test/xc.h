@@ -0,0 +1,33 @@
+// host stand-in for the XC8 device header: just the registers the firmware touches, as plain variables, with
+// flash reads and writes emulated by host.c when the firmware follows RD or WR with a nop
+
+#ifndef XC_H
+#define XC_H
+
+#include <stdint.h>
+
+#define __at(x)
+#define __interrupt()
+#define __section(x)
+#define __asm(x) flash_access()
+#define asm(x) ((void) 0)
+#define NOP() ((void) 0)
+#define CLRWDT() ((void) 0)
+#define SLEEP() ((void) 0)
+#define __XC8_VERSION 2400
+
+void flash_access(void);
+
+extern volatile uint16_t PMADR, PMDAT, TMR1;
+extern volatile uint8_t PMDATL, PMDATH, PMCON2;
+typedef struct {unsigned CFGS:1, RD:1, FREE:1, WREN:1, LWLO:1, WR:1, WRERR:1;} PMCON1bits_t;
+typedef struct {unsigned GIE:1, PEIE:1, TMR0IE:1, TMR0IF:1, IOCIE:1, IOCIF:1;} INTCONbits_t;
+extern volatile PMCON1bits_t PMCON1bits;
+extern volatile INTCONbits_t INTCONbits;
+
+#define PMADRL (((volatile uint8_t*) &PMADR)[0])
+#define PMADRH (((volatile uint8_t*) &PMADR)[1])
+#define TMR1L (((volatile uint8_t*) &TMR1)[0])
+#define TMR1H (((volatile uint8_t*) &TMR1)[1])
+
+#endif
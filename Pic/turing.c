@@ -10,60 +10,330 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "system.h"
+
 
 //**************************************************************************
 // linkage
 //**************************************************************************
 
 extern uint16_t Ticks;
+extern uint16_t LoopRate;
+extern uint16_t IdleRate;
+extern uint16_t Sleeps;
+extern uint8_t MaxStackDepth;
+extern uint8_t ResetFlags;
 
-extern void LED_Flash(void);
+extern void LED_Flash(uint8_t);
 extern void reset_leds(void);
+extern void test_leds(void);
 extern void set_led(void);
+extern void SendReply(uint8_t*, uint8_t);
+extern uint8_t TaskStats(uint8_t*);
 
 void error(int err);
 void skip_instruction(void);
+void program_length(void);
 
 
 //**************************************************************************
 // constants
 //**************************************************************************
 
+// per instruction kind cycle accounting, for development builds only
+//#define OPCODE_STATS
+
+// execution trace of the last steps run, read back with GET_TRACE (its ring takes TRACE_BYTES of RAM)
+#define TRACE
+
+// program read cache big enough to hold a whole 256 byte program, as the RAM interpreter did, for benchmarking only
+//#define RAM_PROGRAM
+
 // error return value
 #define ERROR 0x7fff
 
-// number of squares on the tape
+// number of squares on the LED strip unless set otherwise (one PCB) and the longest strip (0xff reads as erased)
 #define NUM_SQUARES 27
+#define STRIP_MAX 254
 
-// maximum number of variables
-#define MAX_VARIABLES 10
+// longest virtual tape, packed at 3 bits a square with a spare byte for reading across a byte boundary
+#define TAPE_MAX 256
+#define TAPE_BYTES ((TAPE_MAX*3+7)/8+1)
+
+// name arena size, shared by variables and labels: an interned name takes 4 bytes as a variable and 5 as a
+// label, so 19 labels or 24 variables fit (the simulator counts the same budget), and a label that no longer
+// fits is searched for every time it's branched to
+#define NAME_ARENA 96
 
 // maximum number of significant characters in label and variable names
 #define NAME_LEN 10
 
-// maximum program length
-#define MAX_PROGRAM 256
+// deepest parenthesis nesting in an expression
+#define MAX_NESTING 32
+
+// maximum program length (program executes in place from flash)
+#define MAX_PROGRAM 512
+
+// flash row size and number of rows in the flash store (0x1a00 up, room for the settings, two checkpoint sets,
+// the program directory and a longest program being replaced by another, with the rest shared by the slots)
+#define ROW_SIZE 32
+#define STORE_ROWS 48
+
+// flash rows needed for the longest program
+#define PROGRAM_ROWS ((MAX_PROGRAM+ROW_SIZE)/ROW_SIZE)
+
+// no store row
+#define NO_ROW 0xff
+
+// no name in the name arena
+#define NO_NAME 0xff
+
+// number of program slots
+#define NUM_SLOTS 8
+
+// program read cache, direct mapped lines of program flash
+#if defined(RAM_PROGRAM)
+#define CACHE_LINES 16
+#else
+#define CACHE_LINES 4
+#endif
+#define CACHE_LINE 16
+
+// firmware version reported to the host
+#define FIRMWARE_VERSION 1
+
+// capability bits reported to the host
+#define CAP_DIAGNOSTICS 0x0001
+#define CAP_FLASH_PROGRAM 0x0002
+#define CAP_FLASH_STORE 0x0004
+#define CAP_PROGRAM_SLOTS 0x0008
+#define CAP_FAST_START 0x0010
+#define CAP_CHECKPOINT 0x0020
+#define CAP_BACKGROUND_STORE 0x0040
+#define CAP_TOKENISED 0x0080
+#define CAP_VIRTUAL_TAPE 0x0100
+#define CAP_STRIP_LENGTH 0x0200
+#define CAP_CYCLE_DETECT 0x0400
+#define CAP_RUN_STEPS 0x0800
+#if defined(PROFILER)
+#define CAP_PROFILER 0x1000
+#else
+#define CAP_PROFILER 0
+#endif
+#if defined(OPCODE_STATS)
+#define CAP_OPCODE_STATS 0x2000
+#else
+#define CAP_OPCODE_STATS 0
+#endif
+#if defined(TRACE)
+#define CAP_TRACE 0x4000
+#else
+#define CAP_TRACE 0
+#endif
+#define CAP_DEBUG 0x8000
+#define CAPABILITIES (CAP_DIAGNOSTICS | CAP_FLASH_PROGRAM | CAP_FLASH_STORE | CAP_PROGRAM_SLOTS | CAP_FAST_START | CAP_CHECKPOINT | \
+	CAP_BACKGROUND_STORE | CAP_TOKENISED | CAP_VIRTUAL_TAPE | CAP_STRIP_LENGTH | CAP_CYCLE_DETECT | \
+	CAP_RUN_STEPS | CAP_PROFILER | CAP_OPCODE_STATS | CAP_TRACE | CAP_DEBUG)
+
+// second word of capability bits
+#define CAP2_CPU_ACCOUNTING 0x0001
+#define CAP2_SCHEDULER 0x0002
+#define CAPABILITIES2 (CAP2_CPU_ACCOUNTING | CAP2_SCHEDULER)
+
+// interned names, a token byte stands for a name and is followed by the name where it first appears
+#define TOKEN_BASE 0x80
+#define MAX_TOKENS (0xff-TOKEN_BASE)
+
+// machine state saved by a checkpoint and the store rows it fills
+#define CHECKPOINT_SIZE (sizeof(Tape) + sizeof(HeadPosition) + sizeof(ProgramPosition) + sizeof(WaitPeriods) + \
+	NAME_ARENA + sizeof(NamesUsed) + sizeof(TimerEnabled))
+#define CHECKPOINT_ROWS ((CHECKPOINT_SIZE+ROW_SIZE-1)/ROW_SIZE)
+
+// commands
+enum {RESET = 1, LOAD, RUN, STEP, SET_SPEED, SET_HIGHLIGHT, STORE, PING, GET_INFO, GET_STATS, SELECT_SLOT, SET_FAST_START, SET_CHECKPOINT, CHECKPOINT,
+	SET_TAPE, SET_STRIP, SET_CYCLE_DETECT, RUN_STEPS, SET_PROFILE, GET_PROFILE,
+	GET_OPCODE_STATS, GET_TRACE, SET_BREAKPOINT, SET_WATCH, CONTINUE, GET_CPU, GET_TASKS};
+
+// execution trace ring size in bytes (a power of two), about 20 steps at the 3 bytes most steps take
+#define TRACE_BYTES 64
+#define TRACE_MASK (TRACE_BYTES-1)
+
+// trace record header, the symbol written in the low bits then flags for what follows the program position change:
+// an absolute position instead of a signed byte change, the head position, a variable's name token and value,
+// and the ticks since the previous record as a word instead of a byte
+#define TR_SYMBOL_CODE 0x07
+#define TR_SYMBOL 0x08
+#define TR_POSITION 0x10
+#define TR_HEAD 0x20
+#define TR_VARIABLE 0x40
+#define TR_TICKS 0x80
+
+// no symbol written
+#define NO_SYMBOL 0xff
+
+// breakpoints on program positions
+#define NUM_BREAKPOINTS 4
+
+// watchpoints, on a variable or a tape square
+enum {WATCH_VARIABLE, WATCH_SQUARE};
+
+// batch run options (without RUN_COLLAPSE_WAITS each wait period takes a tick) and the reasons a batch ends
+enum {RUN_COLLAPSE_WAITS = 0x01, RUN_HOLD_LEDS = 0x02};
+enum {BATCH_STEPS, BATCH_POSITION, BATCH_HALTED, BATCH_ABORTED};
+
+// background store states
+enum {STORE_IDLE, STORE_LOAD, STORE_COMMIT, STORE_SETTINGS, STORE_VERIFY};
+
+// longest interval between cycle detection hashes (Brent's power of two)
+#define CYCLE_POWER_MAX 0x4000
+
+// shortest checkpoint interval in seconds: a checkpoint writes up to CHECKPOINT_ROWS+1 rows into the two dozen or so
+// rows left free, rewriting each about every third checkpoint, so at 10k erase cycles a row lasts some 40 days of
+// continuous running at this interval
+#define CHECKPOINT_MIN 120
+
+// milliseconds the active slot must stay chosen before it is stored, so stepping through slots stores only the last
+#define SLOT_SETTLE 2000
+
+// program characters a step may scan per pass through the main loop before carrying on next pass
+#define STEP_BUDGET 64
+
+// step states, a step is either seeking its instruction, executing it or searching for a branch's label
+enum {STEP_IDLE, STEP_SEEK, STEP_DECODE, STEP_LABEL};
+
+// decoded instruction cache entries (direct mapped by program position)
+#define DECODE_ENTRIES 8
+
+// decoded instruction kind, the instruction (INS_*) in the low bits, a mode and whether the value is
+// the position of an expression to evaluate rather than a constant
+#define DEC_INSTRUCTION 0x07
+#define DEC_MODE 0x38
+#define DEC_EXPRESSION 0x80
+
+// decoded instruction modes
+enum {MOVE_FIRST = 0x00, MOVE_LAST = 0x08, MOVE_BACK = 0x10, MOVE_FORWARD = 0x18};
+enum {ASSIGN_INC = 0x00, ASSIGN_DEC = 0x08, ASSIGN_SET = 0x10};
+enum {TEST_ZERO = 0x00, TEST_NOT_ZERO = 0x08, TEST_POSITIVE = 0x10, TEST_NOT_NEGATIVE = 0x18, TEST_NEGATIVE = 0x20,
+	TEST_NOT_POSITIVE = 0x28};
+
+// decoded instruction, Next is where the program carries on (for a conditional, if the test passes)
+// and Extra the variable assigned or where a failed conditional carries on
+typedef struct
+{
+	int16_t Position;
+	uint8_t Kind;
+	int16_t Value;
+	int16_t Next;
+	int16_t Extra;
+}
+DECODED;
 
 
 //**************************************************************************
 // variables
 //**************************************************************************
 
-// tape symbols
-char Symbols[NUM_SQUARES];
+// tape symbols, 3-bit codes packed end to end
+uint8_t Tape[TAPE_BYTES];
 
-// program variable names and values
-char VariableNames[MAX_VARIABLES][NAME_LEN+1];
-int8_t VariableValues[MAX_VARIABLES];
+// name arena, entries allocated upwards as the program meets new names, each a kind ('$' variable
+// or '#' label), the name, a terminator then the value, with room past the end for the name being read
+char Names[NAME_ARENA+NAME_LEN+2];
+uint8_t NamesUsed = 0;
 
 // tape head posiiton
-int8_t HeadPosition;
+int16_t HeadPosition;
+
+// first tape square shown on the LED strip
+int16_t ViewStart = 0;
+
+// LEDs in the strip (also used by test_leds) and the time taken to display them in microseconds
+uint8_t NumLeds = NUM_SQUARES;
+uint16_t FrameTime = 0;
+
+// a step has changed what the LED strip should show
+bool DisplayDue = false;
+
+// program cache lines and the program line held in each (-1 if empty)
+char ProgramCache[CACHE_LINES][CACHE_LINE];
+int16_t CacheTags[CACHE_LINES];
+
+// program cache misses
+uint16_t CacheMisses = 0;
+
+// instructions decoded on their first execution (Position -1 if empty) and the entry being filled
+DECODED DecodeCache[DECODE_ENTRIES];
+DECODED* Decoding;
+
+// true while the expression being parsed has only constant operands
+bool ExpressionConstant;
+
+// state of the step in progress, where it started and the characters it may still scan this pass
+uint8_t StepState = STEP_IDLE;
+int16_t StepStart;
+uint8_t StepBudget;
+
+// true if a scan stopped inside a comment
+bool InComment;
 
-// current program
-char Program[MAX_PROGRAM+1] = {'\0'};
+// true while decoding without executing, and set if an error was met meanwhile
+bool Speculating = false;
+bool SpeculationFailed;
+
+// program position the idle time is decoding ahead from and how far it has got
+int16_t PredecodeFrom = -1;
+uint8_t PredecodeStage;
+
+// longest a tick has spent stepping since reset, in microseconds
+uint16_t MaxStepTime = 0;
+
+// label being searched for, the arena size before it was added and the arena index of its position
+// (NO_NAME if the arena was full)
+uint8_t LabelUsed;
+uint8_t LabelValue;
+
+// program row being loaded and its row number (-1 if none)
+uint8_t LoadRow[ROW_SIZE];
+int8_t LoadRowIndex = -1;
+
+// name being loaded and its length (-1 if none, 0 until it starts), the number of names interned by the load
+// and whether the load is in a comment
+char LoadName[NAME_LEN];
+int8_t LoadNameLen = -1;
+uint8_t LoadTokens = 0;
+bool LoadComment = false;
+
+// store rows holding the active slot's program, the settings and the program directory (NO_ROW if none)
+uint8_t ProgramRows[PROGRAM_ROWS];
+uint8_t SettingsRow = NO_ROW;
+uint8_t DirectoryRow = NO_ROW;
+
+// store rows a load has replaced, kept until the load is committed, and rows no longer needed, erased in the
+// background, one bit per row
+uint8_t StaleRows[(STORE_ROWS+7)/8];
+uint8_t ObsoleteRows[(STORE_ROWS+7)/8];
+
+// whether a load is waiting to be committed, whether it has changed any row and whether a row failed to reach flash
+bool LoadOpen = false;
+bool LoadChanged = false;
+bool LoadFailed = false;
+
+// store rows in use, one bit per row
+uint8_t UsedRows[(STORE_ROWS+7)/8];
+
+// next store row to try when allocating and last sequence number written
+uint8_t NextRow = 0;
+uint16_t Sequence = 0;
+
+// store row scratch buffer
+uint8_t RowData[ROW_SIZE];
+
+// flash erase and write counts
+uint16_t FlashErases = 0;
+uint16_t FlashWrites = 0;
 
 // program length
-uint8_t ProgramLength = 0;
+uint16_t ProgramLength = 0;
 
 // program position
 int16_t ProgramPosition;
@@ -79,9 +349,91 @@ struct
 
 	// tapehead highlighting
 	bool TapeheadHighlighting;
+
+	// active program slot
+	uint8_t ActiveSlot;
+
+	// start a stored program at power-up without the LED self test
+	bool FastStart;
+
+	// seconds of running time between checkpoints, 0 for none
+	uint8_t CheckpointInterval;
+
+	// virtual tape length in squares
+	uint16_t TapeLength;
+
+	// LEDs in the strip, several PCBs may be chained
+	uint8_t StripLength;
+
+	// park a program found cycling through the same states without waiting, 0 for off
+	uint8_t CycleDetection;
 }
 Settings;
 
+// cycle detection, the machine state hash last saved, steps since then and the interval before saving again,
+// whether a wait has run since, and the cycle length found (0 if none) with the steps left to confirm it
+uint32_t CycleHash;
+uint16_t CycleSteps;
+uint16_t CyclePower;
+bool CycleWaited;
+uint16_t CycleLength = 0;
+uint16_t CycleConfirm;
+
+// batch run, whether one is running, steps to run (0 for no limit), position to stop at (-1 for none), options
+// and whether the timer was running before, then the steps run and ticks taken so far
+bool Batching = false;
+uint16_t BatchLimit;
+int16_t BatchStop;
+uint8_t BatchFlags;
+bool BatchTimer;
+uint32_t BatchSteps;
+uint32_t BatchTicks;
+uint16_t BatchPrevTicks;
+
+#if defined(PROFILER)
+// sampling profiler, program positions the profile timer finds a step at: the first position profiled, a bucket's
+// positions as a power of two (PROFILE_OFF when off), the bucket counts, the samples falling outside them and
+// the samples finding no step running
+int16_t ProfileStart = 0;
+uint8_t ProfileShift = PROFILE_OFF;
+uint16_t Profile[PROFILE_BUCKETS];
+uint16_t ProfileMissed;
+uint16_t ProfileIdle;
+#endif
+
+#if defined(TRACE)
+// execution trace, a ring of records of the steps run, each recording what changed since the one before: where the
+// oldest record starts and the bytes in use, the state the oldest record changes and the state the newest leaves
+uint8_t Trace[TRACE_BYTES];
+uint8_t TraceTail = 0;
+uint8_t TraceUsed = 0;
+int16_t TraceBasePosition = 0;
+uint8_t TraceBaseHead = 0;
+uint16_t TraceBaseTicks = 0;
+int16_t TracePosition = 0;
+uint8_t TraceHead = 0;
+uint16_t TraceTicks = 0;
+#endif
+
+// what the step being run has changed, for the trace and watchpoints, and the last error
+uint8_t TraceSymbol;
+uint8_t TraceVariable;
+uint8_t TraceError = 0;
+
+// breakpoints and watchpoints: whether any is set, the positions a step arriving at stops the machine (-1 for none),
+// the variable watched (as named in the arena, empty for none) with its arena index once known and last value,
+// and the tape square watched (-1 for none) with its last symbol
+bool DebugArmed = false;
+int16_t Breakpoints[NUM_BREAKPOINTS] = {-1, -1, -1, -1};
+char WatchName[NAME_LEN+1] = "";
+uint8_t WatchVariable = NO_NAME;
+int8_t WatchValue;
+int16_t WatchSquare = -1;
+char WatchSymbol;
+
+// true while the interpreter runs a step, so the profiler can tell time spent stepping
+bool Stepping = false;
+
 // LED components
 uint8_t cnt, red, green, blue;
 
@@ -92,907 +444,3112 @@ bool TimerEnabled = false;
 uint16_t TimerCnt = 1000 / 1;
 
 // previous ticks
-uint16_t PrevTicks = (unsigned) -1;
+uint16_t PrevTicks = (uint16_t) -1;
+
+// ticks from timer start to the first frame after power-up
+uint16_t BootTicks = 0;
+
+// store rows holding the two checkpoint sets, data rows then the commit row (NO_ROW if none)
+uint8_t CheckpointRows[2][CHECKPOINT_ROWS+1];
+
+// checkpoint set to write next and the row being written (-1 if no checkpoint in progress)
+uint8_t CheckpointSet = 0;
+int8_t CheckpointRow = -1;
+
+// running time since the last checkpoint
+uint16_t CheckpointMs = 0;
+uint8_t CheckpointSecs = 0;
+
+// background store state, program row being verified and whether the store ends a load
+uint8_t StoreState = STORE_IDLE;
+uint8_t StoreRow;
+bool StoreEndsLoad;
+
+// background store outcome and CRC of the program and settings read back from flash
+bool StoreOk;
+uint8_t StoreCrc;
+
+// the active slot is waiting to be stored, and the tick it was chosen on
+bool SlotDirty = false;
+uint16_t SlotTicks;
 
 
 //**************************************************************************
 // flash functions
 //**************************************************************************
 
-// flash storage locations (end of memory)
-#define PROGRAM_BASE 0x1e00
-#define PROGRAM_SIZE (((MAX_PROGRAM+1)/32+1)*32)
-#define SETTINGS_BASE (PROGRAM_BASE+PROGRAM_SIZE)
-#define SETTINGS_SIZE ((sizeof(Settings)/32+1)*32)
-const uint8_t Program_[PROGRAM_SIZE] __at(PROGRAM_BASE) = {0};
-const uint8_t Settings_[SETTINGS_SIZE] __at(SETTINGS_BASE) = {0};
-
-// reads a byte from memory
-uint8_t read_byte(uint16_t addr)
+// flash store (end of memory), a pool of rows each tagged with a header
+#define STORE_BASE (0x2000-STORE_ROWS*ROW_SIZE)
+const uint8_t Store_[STORE_ROWS*ROW_SIZE] __at(STORE_BASE) = {0};
+
+// store areas, programs use one area per slot
+#define AREA_PROGRAM 0x00
+#define AREA_SETTINGS 0x80
+#define AREA_CHECKPOINT 0x90
+#define AREA_DIRECTORY 0xa0
+
+// program directory, written last by a load to commit it: each slot's generation, the sequence number of the
+// last row written when it was committed (a row written after it belongs to a load cut short), and its length
+// (NO_LENGTH if the slot has never been committed)
+#define NO_LENGTH 0xffff
+typedef struct
 {
-	PMADR = addr;
+	uint16_t Generations[NUM_SLOTS];
+	uint16_t Lengths[NUM_SLOTS];
+}
+PROGRAM_DIRECTORY;
 
-	PMCON1bits.CFGS = 0;
-	PMCON1bits.RD = 1;
-	__asm("nop");
-	__asm("nop");
+// row header, held in the upper nibbles of the first HEADER_WORDS words of a row
+#define HEADER_WORDS 10
+typedef struct
+{
+	uint8_t Area;
+	uint8_t Row;
+	uint16_t Sequence;
+	uint8_t Crc;
+}
+ROW_HEADER;
 
-	return PMDATL;
+// returns the flash address of a store row
+inline uint16_t row_address(uint8_t row)
+{
+	return STORE_BASE + (uint16_t) row * ROW_SIZE;
 }
 
 // reads from memory
 void read_mem(uint16_t addr, uint16_t len, uint8_t* dst)
 {
-	while (len-- > 0) *dst++ = read_byte(addr++);
+	PMADR = addr;
+	PMCON1bits.CFGS = 0;
+
+	while (len-- > 0)
+	{
+		PMCON1bits.RD = 1;
+		__asm("nop");
+		__asm("nop");
+
+		*dst++ = PMDATL;
+		PMADR++;
+	}
 }
 
-// writes to memory
-void write_mem(uint16_t addr, uint16_t len, uint8_t* src)
+// reads a store row header, fed with row number and header pointer
+void read_header(uint8_t row, ROW_HEADER* header)
 {
-	INTCONbits.GIE = 0;
+	uint8_t* h = (uint8_t*) header;
 
-	#define ROW_ERASE 32
+	PMADR = row_address(row);
+	PMCON1bits.CFGS = 0;
 
-	// erase rows
-	for (uint8_t i = 0; i <= (len/ROW_ERASE); i++)
+	for (uint8_t i = 0; i < HEADER_WORDS; i++)
 	{
-		PMADR = addr + i * ROW_ERASE;
-
-		PMCON1bits.CFGS = 0;
-		PMCON1bits.FREE = 1;
-		PMCON1bits.WREN = 1;
-
-		PMCON2 = 0x55;
-		PMCON2 = 0xaa;
-		PMCON1bits.WR = 1;
+		PMCON1bits.RD = 1;
 		__asm("nop");
 		__asm("nop");
 
-		PMCON1bits.WREN = 0;
+		if (i & 1) *h++ |= PMDATH & 0x0f;
+		else *h = (uint8_t) (PMDATH << 4);
+
+		PMADR++;
 	}
+}
 
-	#define WRITE_LATCHES 32
+// reads a store row, fed with row number, header and data pointers, returns true if erased
+bool read_row(uint8_t row, ROW_HEADER* header, uint8_t* dst)
+{
+	uint8_t* h = (uint8_t*) header;
+	bool erased = true;
 
-	// write rows
-	for (uint8_t i = 0; i <= (len/WRITE_LATCHES); i++)
-	{
-		PMADR = addr + i * WRITE_LATCHES;
+	PMADR = row_address(row);
+	PMCON1bits.CFGS = 0;
 
-		PMCON1bits.CFGS = 0;
-		PMCON1bits.WREN = 1;
+	for (uint8_t i = 0; i < ROW_SIZE; i++)
+	{
+		PMCON1bits.RD = 1;
+		__asm("nop");
+		__asm("nop");
 
-		PMCON1bits.LWLO = 1;
+		if (PMDATH != 0x3f || PMDATL != 0xff) erased = false;
 
-		while (true)
+		if (i < HEADER_WORDS)
 		{
-			PMDAT = (uint16_t) *src++;
-
-			#define MASK (WRITE_LATCHES-1)
-			if ((PMADRL & MASK) == MASK) break;
-
-			PMCON2 = 0x55;
-			PMCON2 = 0xaa;
-			PMCON1bits.WR = 1;
-			__asm("nop");
-			__asm("nop");
-
-			PMADR++;
+			if (i & 1) *h++ |= PMDATH & 0x0f;
+			else *h = (uint8_t) (PMDATH << 4);
 		}
 
-		PMCON1bits.LWLO = 0;
-
-		PMCON2 = 0x55;
-		PMCON2 = 0xaa;
-		PMCON1bits.WR = 1;
-		__asm("nop");
-		__asm("nop");
-
-		PMCON1bits.WREN = 0;
+		*dst++ = PMDATL;
+		PMADR++;
 	}
 
-	INTCONbits.GIE = 1;
+	return erased;
 }
 
+// starts a flash erase or write, interrupts are held off only for the unlock sequence
+void unlock_flash(void)
+{
+	INTCONbits.GIE = 0;
 
-//**************************************************************************
-// helper functions
-//**************************************************************************
+	PMCON2 = 0x55;
+	PMCON2 = 0xaa;
+	PMCON1bits.WR = 1;
+	__asm("nop");
+	__asm("nop");
 
-// errors
-enum
-{
-	ERR_SYNTAX_ERROR = 1,
-	ERR_INSTRUCTION_ERROR = 2,
-	ERR_OPERAND_ERROR = 3,
-	ERR_TOO_MANY_VARIABLES = 4,
-	ERR_VARIABLE_NOT_FOUND = 5,
-	ERR_LABEL_NOT_FOUND = 6
-};
+	INTCONbits.GIE = 1;
+}
 
-// displays all tape symbols
-void update_tape(void)
+// erases a store row
+void erase_row(uint8_t row)
 {
-	#define HI_BRIGHTNESS 0x60
-	#define LO_BRIGHTNESS 0x20
+	uint8_t bucket = CPU_Account(CPU_FLASH);
 
-	reset_leds();
+	PMADR = row_address(row);
 
-	char* p = Symbols;
+	PMCON1bits.CFGS = 0;
+	PMCON1bits.FREE = 1;
+	PMCON1bits.WREN = 1;
 
-	for (uint8_t i = 0; i < NUM_SQUARES; i++)
-	{
-		uint8_t brightness = LO_BRIGHTNESS;
-		if (Settings.TapeheadHighlighting && i == HeadPosition) brightness = HI_BRIGHTNESS;
+	unlock_flash();
 
-		switch (*p++)
-		{
-		case 'R':
-			red = brightness; green = blue = 0;
-			break;
-		case 'G':
-			green = brightness; red = blue = 0;
-			break;
-		case 'B':
-			blue = brightness; red = green = 0;
-			break;
-		case 'C':
-			green = blue = brightness; red = 0;
-			break;
-		case 'M':
-			red = blue = brightness; green = 0;
-			break;
-		case 'Y':
-			red = green = brightness; blue = 0;
-			break;
-		case 'W':
-			red = green = blue = brightness;
-			break;
-		case 'K':
-			red = green = blue = 0;
-			break;
-		default:
-			red = green = blue = 0;
-			break;
-		}
+	PMCON1bits.WREN = 0;
 
-		set_led();
-	}
-}
+	FlashErases++;
 
-// returns length of a string (excluding zero terminator)
-uint8_t str_len(char* s)
-{
-	uint8_t len = 0;
-	while (*s++ != '\0') len++;
-	return len;
+	CPU_Account(bucket);
 }
 
-// returns true if two strings match
-bool cmp_strs(char* s1, char* s2)
+// writes an erased store row, fed with row number, header and data pointers
+void write_row(uint8_t row, ROW_HEADER* header, uint8_t* src)
 {
-	while (true)
+	uint8_t* h = (uint8_t*) header;
+
+	uint8_t bucket = CPU_Account(CPU_FLASH);
+
+	PMADR = row_address(row);
+
+	PMCON1bits.CFGS = 0;
+	PMCON1bits.WREN = 1;
+
+	PMCON1bits.LWLO = 1;
+
+	for (uint8_t i = 0; true; i++)
 	{
-		if (*s1 == '\0' && *s2 == '\0') return true;
-		if (*s1++ != *s2++) return false;
+		// header nibbles go in the upper bits of the word
+		uint8_t nibble = 0x0f;
+		if (i < HEADER_WORDS) nibble = (i & 1) ? *h++ & 0x0f : *h >> 4;
+
+		PMDAT = ((uint16_t) nibble << 8) | *src++;
+
+		#define MASK (ROW_SIZE-1)
+		if ((PMADRL & MASK) == MASK) break;
+
+		unlock_flash();
+
+		PMADR++;
 	}
+
+	PMCON1bits.LWLO = 0;
+
+	unlock_flash();
+
+	PMCON1bits.WREN = 0;
+
+	FlashWrites++;
+
+	CPU_Account(bucket);
 }
 
-// copies a string
-void copy_str(char* s, char* d)
+// CRC-8 (polynomial x^8 + x^2 + x + 1) lookup table
+const uint8_t Crc8Table[256] =
 {
-	char c;
-	do
-	{
-		c = *d++ = *s++;
-	}
-	while (c != '\0');
-}
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
+};
 
-// returns current character in program
-inline char current(void)
+// CRC-8, fed with running CRC, data pointer and length
+uint8_t crc8(uint8_t crc, uint8_t* p, uint8_t len)
 {
-	return ProgramPosition >= ProgramLength ? '\0' : Program[ProgramPosition];
+	while (len-- > 0) crc = Crc8Table[crc ^ *p++];
+	return crc;
 }
 
-// steps over current character in program
-inline void step(void)
+// returns the CRC of a row header and data
+uint8_t row_crc(ROW_HEADER* header, uint8_t* data)
 {
-	if (ProgramPosition < ProgramLength) ProgramPosition++;
+	return crc8(crc8(0xff, (uint8_t*) header, 4), data, ROW_SIZE);
 }
 
-// returns next character in program
-inline char next(void)
+// returns true if a row is set in a store row bitmap
+bool row_in(uint8_t* rows, uint8_t row)
 {
-	return ProgramPosition >= ProgramLength ? '\0' : (++ProgramPosition >= ProgramLength ? '\0' : Program[ProgramPosition]);
+	return (rows[row >> 3] & (1 << (row & 7))) != 0;
 }
 
-// returns true if end of program
-inline bool end_of_program(void)
+// marks a store row as used or free
+void mark_row(uint8_t row, bool used)
 {
-	return ProgramPosition >= ProgramLength;
+	uint8_t bit = (uint8_t) (1 << (row & 7));
+	if (used) UsedRows[row >> 3] |= bit;
+	else UsedRows[row >> 3] &= (uint8_t) ~bit;
 }
 
-// returns true if valid character in label or variable name
-bool is_name(char c)
+// returns true if a store row is in use
+bool row_used(uint8_t row)
 {
-	return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_';
+	return row_in(UsedRows, row);
 }
 
-// returns true if symbol
-bool is_symbol(char c)
+// releases a store row
+void free_row(uint8_t row)
 {
-	return c == 'R' || c == 'G' || c == 'B' || c == 'C' || c == 'M' || c == 'Y' || c == 'W' || c == 'K';
+	if (row == NO_ROW) return;
+	erase_row(row);
+	mark_row(row, false);
+	ObsoleteRows[row >> 3] &= (uint8_t) ~(1 << (row & 7));
 }
 
-// returns true if arithmetic or bitwise operator
-bool is_operator(char c)
+// marks a store row to be released once the load replacing it is committed
+void mark_stale(uint8_t row)
 {
-	return c == '+' || c == '-' || c == '*' || c == '/' || c == '&' || c == '|';
+	if (row == NO_ROW) return;
+	StaleRows[row >> 3] |= (uint8_t) (1 << (row & 7));
 }
 
-// returns true if start of expression
-bool is_expression(char c)
+// marks a store row to be released in the background
+void mark_obsolete(uint8_t row)
 {
-	return (c >= '0' && c <= '9') || c == '-' || c == '$' || c == '(';
+	if (row == NO_ROW) return;
+	ObsoleteRows[row >> 3] |= (uint8_t) (1 << (row & 7));
 }
 
-// parses a decimal number
-int8_t get_number(void)
+// releases an obsolete store row, checkpoint commit rows first so a discarded set stops being valid as soon as
+// possible, returns false if there are none left
+bool reclaim_row(void)
 {
-	bool negate = current() == '-';
-	if (negate) step();
+	ROW_HEADER header;
+	uint8_t found = NO_ROW;
 
-	int8_t n = 0;
-	while (current() != '\0' && (current() >= '0' && current() <= '9'))
+	for (uint8_t row = 0; row < STORE_ROWS; row++)
 	{
-		n = n * 10 + (int8_t) (current() - '0');
-		step();
+		if (!row_in(ObsoleteRows, row)) continue;
+
+		read_header(row, &header);
+		if ((header.Area & ~1) == AREA_CHECKPOINT && header.Row == CHECKPOINT_ROWS)
+		{
+			found = row;
+			break;
+		}
+		if (found == NO_ROW) found = row;
 	}
 
-	return negate ? -n : n;
+	if (found == NO_ROW) return false;
+
+	free_row(found);
+	return true;
 }
 
-// skips over whitespace and comments, returns true if end of program
-bool skip_space(void)
+// maps the newer of two copies of a row, an interrupted update leaves both, fed with the row found, its header
+// and the mapping of any copy already found
+void newest_copy(uint8_t row, ROW_HEADER* header, uint8_t* map)
 {
-	while (true)
+	ROW_HEADER other;
+
+	if (*map != NO_ROW)
 	{
-		if (current() == ';')
+		read_header(*map, &other);
+		if ((int16_t) (header->Sequence - other.Sequence) < 0)
 		{
-			// comment - skip to end of line
-			while (next() != '\0' && current() != '\n') ;
+			free_row(row);
+			return;
 		}
-		else if (current() == ' ' || current() == '\t' || current() == '\r' || current() == '\n')
+		free_row(*map);
+	}
+
+	*map = row;
+}
+
+// scans the store for the newest copy of every row of a program slot, the settings and the checkpoints,
+// fed with slot and whether to check every row (once at power-up, after which only valid rows remain)
+void mount_store(uint8_t slot, bool verify)
+{
+	ROW_HEADER header;
+	uint16_t generation = 0;
+	uint16_t length = NO_LENGTH;
+	bool sequenced = false;
+
+	for (uint8_t i = 0; i < PROGRAM_ROWS; i++) ProgramRows[i] = NO_ROW;
+	SettingsRow = NO_ROW;
+	DirectoryRow = NO_ROW;
+	for (uint8_t i = 0; i < CHECKPOINT_ROWS+1; i++) CheckpointRows[0][i] = CheckpointRows[1][i] = NO_ROW;
+	for (uint8_t i = 0; i < sizeof(UsedRows); i++) UsedRows[i] = StaleRows[i] = 0;
+	if (verify) for (uint8_t i = 0; i < sizeof(ObsoleteRows); i++) ObsoleteRows[i] = 0;
+	if (verify) Sequence = 0;
+
+	for (uint8_t row = 0; row < STORE_ROWS; row++)
+	{
+		if (verify)
 		{
-			step();
+			if (read_row(row, &header, RowData)) continue;
+
+			// release anything torn or foreign
+			if (header.Crc != row_crc(&header, RowData) ||
+				!((header.Area < NUM_SLOTS && header.Row < PROGRAM_ROWS) || (header.Area == AREA_SETTINGS && header.Row == 0) ||
+				((header.Area & ~1) == AREA_CHECKPOINT && header.Row <= CHECKPOINT_ROWS) ||
+				(header.Area == AREA_DIRECTORY && header.Row == 0)))
+			{
+				free_row(row);
+				continue;
+			}
+
+			// counting carries on from the newest row, compared with a row in the store since the numbers wrap
+			if (!sequenced || (int16_t) (header.Sequence - Sequence) > 0) Sequence = header.Sequence;
+			sequenced = true;
 		}
 		else
 		{
-			break;
+			// erased rows have an all ones header
+			read_header(row, &header);
+			if (header.Area == 0xff) continue;
 		}
-	}
 
-	return end_of_program();
-}
+		mark_row(row, true);
 
-// parses a label or variable name
-char* get_name(void)
-{
-	static char name[NAME_LEN+1];
-	uint8_t i = 0;
+		// rows waiting to be erased are no longer part of anything
+		if (row_in(ObsoleteRows, row)) continue;
 
-	skip_space();
-	while (is_name(current()))
-	{
-		if (i < NAME_LEN) name[i++] = current();
-		step();
+		// program rows wait until the directory says which of them are committed
+		if (header.Area == AREA_SETTINGS) newest_copy(row, &header, &SettingsRow);
+		else if ((header.Area & ~1) == AREA_CHECKPOINT && header.Row <= CHECKPOINT_ROWS)
+			newest_copy(row, &header, &CheckpointRows[header.Area & 1][header.Row]);
+		else if (header.Area == AREA_DIRECTORY) newest_copy(row, &header, &DirectoryRow);
 	}
-	name[i] = '\0';
-
-	return name;
-}
 
-// finds a variable, returns variable index or -1 if not found
-int8_t find_variable(char* name)
-{
-	for (uint8_t i = 0; i < MAX_VARIABLES; i++)
+	if (DirectoryRow != NO_ROW)
 	{
-		if (VariableNames[i][0] == '\0') continue;
-		if (cmp_strs(VariableNames[i], name)) return (int8_t) i;
+		PROGRAM_DIRECTORY* directory = (PROGRAM_DIRECTORY*) RowData;
+		read_mem(row_address(DirectoryRow), sizeof(PROGRAM_DIRECTORY), RowData);
+		generation = directory->Generations[slot];
+		length = directory->Lengths[slot];
 	}
-	return -1;
-}
 
-// adds a new variable, fed with name and value, returns variable index or -1 if error
-int8_t add_variable(char* name, int8_t value)
-{
-	uint8_t i;
-	for (i = 0; i < MAX_VARIABLES; i++)
+	for (uint8_t row = 0; row < STORE_ROWS; row++)
 	{
-		if (VariableNames[i][0] == '\0') break;
-	}
-	if (i >= MAX_VARIABLES) return -1;
+		if (!row_used(row) || row_in(ObsoleteRows, row)) continue;
 
-	copy_str(name, VariableNames[i]);
-	VariableValues[i] = value;
+		read_header(row, &header);
+		if (header.Area != AREA_PROGRAM + slot) continue;
+
+		// rows written after the slot's generation belong to a load cut short, rows past its end to a longer program
+		if (length == NO_LENGTH || (int16_t) (header.Sequence - generation) > 0 || header.Row > length / ROW_SIZE ||
+			header.Row >= PROGRAM_ROWS)
+		{
+			free_row(row);
+			continue;
+		}
 
-	return (int8_t) i;
+		newest_copy(row, &header, &ProgramRows[header.Row]);
+	}
 }
 
-// parses an operand (symbol, variable or decimal number), returns ERROR if error
-int16_t get_operand(void)
+// returns a free, erased store row or NO_ROW if the store is full
+uint8_t alloc_row(void)
 {
-	skip_space();
+	ROW_HEADER header;
 
-	if (is_symbol(current()))
+	for (uint8_t pass = 0; pass < 2; pass++)
 	{
-		char symbol = current();
-		step();
-		// off-tape squares read as black
-		if (HeadPosition < 0 || HeadPosition >= NUM_SQUARES) return symbol == 'K' ? 1 : 0;
-		return Symbols[HeadPosition] == symbol ? 1 : 0;
-	}
+		// rotate through the store so every row wears evenly
+		for (uint8_t i = 0; i < STORE_ROWS; i++)
+		{
+			uint8_t row = NextRow;
+			if (++NextRow >= STORE_ROWS) NextRow = 0;
 
-	else if (current() == '$')
-	{
-		step();
-		char* variable = get_name();
-		int8_t ndx = find_variable(variable);
-		if (ndx != -1) return VariableValues[ndx];
-		error(ERR_VARIABLE_NOT_FOUND);
-		return ERROR;
-	}
+			if (row_used(row)) continue;
 
-	else if (current() == '-' || (current() >= '0' && current() <= '9'))
-	{
-		return get_number();
+			if (!read_row(row, &header, RowData)) erase_row(row);
+			return row;
+		}
+
+		// a full store takes a row still waiting to be erased in the background
+		if (!reclaim_row()) break;
 	}
 
-	error(ERR_OPERAND_ERROR);
-	return ERROR;
+	return NO_ROW;
 }
 
-// parses an expression, returns ERRIR if error
-int16_t __reentrant get_expression(void)
+// makes sure the row alloc_row() hands out next is erased, so the background store erases and writes in separate
+// passes, returns false if that took an erase
+bool ready_row(void)
 {
-	skip_space();
+	ROW_HEADER header;
+	uint8_t row = NextRow;
 
-	int16_t result;
-	if (current() == '(')
+	for (uint8_t i = 0; i < STORE_ROWS; i++)
 	{
-		step();
-		result = get_expression();
-		if (current() != ')') return ERROR;
-		step();
+		if (!row_used(row))
+		{
+			if (read_row(row, &header, RowData)) return true;
+
+			erase_row(row);
+			return false;
+		}
+
+		if (++row >= STORE_ROWS) row = 0;
 	}
-	else
+
+	// a full store needs a row still waiting to be erased in the background
+	return !reclaim_row();
+}
+
+// stores a row, fed with area, row number within area, current store row and data pointer,
+// returns the store row now holding the data or NO_ROW if the store is full
+uint8_t store_row(uint8_t area, uint8_t ndx, uint8_t current, uint8_t* src)
+{
+	ROW_HEADER header;
+
+	// skip unchanged rows, unless so old its sequence number could be taken for a newer one
+	if (current != NO_ROW)
 	{
-		result = get_operand();
+		read_row(current, &header, RowData);
+
+		uint8_t i;
+		for (i = 0; i < ROW_SIZE; i++) if (RowData[i] != src[i]) break;
+		if (i == ROW_SIZE && (uint16_t) (Sequence - header.Sequence) < 0x4000) return current;
 	}
-	if (result == ERROR) return ERROR;
 
-	while (true)
+	uint8_t row = alloc_row();
+	if (row == NO_ROW) return NO_ROW;
+
+	header.Area = area;
+	header.Row = ndx;
+	header.Sequence = ++Sequence;
+	header.Crc = row_crc(&header, src);
+
+	write_row(row, &header, src);
+	mark_row(row, true);
+
+	// retire the old copy in the background, a program row's once the load replacing it is committed
+	if (area < NUM_SLOTS) mark_stale(current), LoadChanged = true;
+	else mark_obsolete(current);
+
+	return row;
+}
+
+
+//**************************************************************************
+// helper functions
+//**************************************************************************
+
+// errors
+enum
+{
+	ERR_SYNTAX_ERROR = 1,
+	ERR_INSTRUCTION_ERROR = 2,
+	ERR_OPERAND_ERROR = 3,
+	ERR_TOO_MANY_NAMES = 4,
+	ERR_VARIABLE_NOT_FOUND = 5,
+	ERR_LABEL_NOT_FOUND = 6,
+	ERR_STORE_FULL = 7,
+	ERR_NESTING_TOO_DEEP = 8
+};
+
+// symbols by tape code, black first so a cleared tape is all black
+const char SymbolChars[8] = {'K', 'R', 'G', 'B', 'C', 'M', 'Y', 'W'};
+
+// instructions by first character, numbered for dispatch
+enum {INS_NONE, INS_MOVEMENT, INS_ASSIGNMENT, INS_CONDITIONAL, INS_BRANCH, INS_WAIT, INS_SET};
+
+// instruction kinds timed, the instruction numbers (a conditional that passes its test) then a conditional that
+// fails it and a display refresh
+enum {OP_CONDITIONAL_SKIPPED = INS_SET+1, OP_REFRESH, OP_KINDS};
+
+// character classes, held with the instruction a character starts in the low bits
+#define CC_INSTRUCTION 0x07
+#define CC_NAME 0x08
+#define CC_OPERATOR 0x10
+#define CC_EXPRESSION 0x20
+#define CC_SPACE 0x40
+#define CC_DIGIT 0x80
+
+// class of every character, so decoding is one table read rather than a chain of comparisons
+const uint8_t CharClass[256] =
+{
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x40, 0x00, 0x00, 0x40, 0x00, 0x00,	// 0x00
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	// 0x10
+	0x40, 0x00, 0x00, 0x00, 0x22, 0x05, 0x10, 0x00, 0x20, 0x00, 0x10, 0x10, 0x00, 0x30, 0x00, 0x10,	// 0x20
+	0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0xa8, 0x00, 0x00, 0x01, 0x00, 0x01, 0x03,	// 0x30
+	0x00, 0x00, 0x06, 0x06, 0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x06, 0x00, 0x06, 0x00, 0x00,	// 0x40
+	0x00, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x04, 0x08,	// 0x50
+	0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,	// 0x60
+	0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x00, 0x10, 0x00, 0x00, 0x00,	// 0x70
+	// 0x80 - 0xff are tokens and stray bytes, none of which start anything
+};
+
+// returns the class of a character
+#define char_class(c) CharClass[(uint8_t) (c)]
+
+// returns the symbol on a tape square, off-tape squares read as black
+char get_symbol(int16_t pos)
+{
+	if (pos < 0 || pos >= (int16_t) Settings.TapeLength) return 'K';
+
+	uint16_t bit = (uint16_t) pos * 3;
+	uint8_t* p = &Tape[bit >> 3];
+
+	return SymbolChars[(uint8_t) ((p[0] | (uint16_t) p[1] << 8) >> (bit & 7)) & 7];
+}
+
+// sets the symbol on a tape square, off-tape squares can't be set
+void set_symbol(int16_t pos, char symbol)
+{
+	if (pos < 0 || pos >= (int16_t) Settings.TapeLength) return;
+
+	uint8_t code = 0;
+	while (code < 7 && SymbolChars[code] != symbol) code++;
+	TraceSymbol = code;
+
+	uint16_t bit = (uint16_t) pos * 3;
+	uint8_t* p = &Tape[bit >> 3];
+	uint8_t shift = bit & 7;
+
+	uint16_t word = (p[0] | (uint16_t) p[1] << 8) & (uint16_t) ~(7 << shift);
+	word |= (uint16_t) code << shift;
+	p[0] = (uint8_t) word;
+	p[1] = (uint8_t) (word >> 8);
+}
+
+// changes the virtual tape length, fed with length, clearing any squares dropped so they come back black
+// and keeping the head no more than one square off the end
+void set_tape_length(uint16_t length)
+{
+	for (int16_t pos = (int16_t) length; pos < (int16_t) Settings.TapeLength; pos++) set_symbol(pos, 'K');
+
+	Settings.TapeLength = length;
+	if (HeadPosition > (int16_t) length) HeadPosition = (int16_t) length;
+}
+
+// scrolls the LED strip to keep the head in view
+void follow_head(void)
+{
+	int16_t last = (int16_t) Settings.TapeLength - NumLeds;
+
+	if (HeadPosition < ViewStart) ViewStart = HeadPosition;
+	else if (HeadPosition >= ViewStart + NumLeds) ViewStart = HeadPosition - (NumLeds-1);
+
+	if (ViewStart > last) ViewStart = last;
+	if (ViewStart < 0) ViewStart = 0;
+}
+
+// returns a free running count of microseconds, from the tick count and timer 1 (reloaded with -12000 each tick)
+uint16_t micros(void)
+{
+	uint16_t ticks, timer;
+
+	do
 	{
-		skip_space();
+		ticks = Ticks;
+		timer = TMR1;
+	}
+	while (ticks != *(volatile uint16_t*) &Ticks);
 
-		if (current() == ')') break;
+	return ticks * 1000 + (uint16_t) (timer + 12000) / 12;
+}
 
-		char op = current();
-		if (!is_operator(op)) break;
+#if defined(OPCODE_STATS)
+// instruction cycles taken by an instruction kind, the count saturates rather than skewing the mean
+typedef struct
+{
+	uint16_t Count;
+	uint32_t Total;
+	uint32_t Min;
+	uint32_t Max;
+}
+OPCODE_STAT;
 
-		step();
+OPCODE_STAT OpcodeStats[OP_KINDS];
 
-		int16_t operand = get_operand();
-		if (operand == ERROR) return ERROR;
+// kind of instruction the step is running and the cycles it has taken in earlier passes
+uint8_t StepKind;
+uint32_t StepCycles;
 
-		switch (op)
+// tick count and timer 1 when timing started
+uint16_t StampTicks, StampTimer;
+
+// starts timing
+void stamp(void)
+{
+	do
+	{
+		StampTicks = Ticks;
+		StampTimer = TMR1;
+	}
+	while (StampTicks != *(volatile uint16_t*) &Ticks);
+}
+
+// returns the instruction cycles since timing started (timer 1 counts up from -12000 each tick)
+uint32_t cycles_since(void)
+{
+	uint16_t ticks, timer;
+
+	do
+	{
+		ticks = Ticks;
+		timer = TMR1;
+	}
+	while (ticks != *(volatile uint16_t*) &Ticks);
+
+	return (uint32_t) (uint16_t) (ticks - StampTicks) * 12000 + (int16_t) (timer - StampTimer);
+}
+
+// adds to an instruction kind's cycles, fed with kind and cycles taken
+void count_cycles(uint8_t kind, uint32_t cycles)
+{
+	OPCODE_STAT* stat = &OpcodeStats[kind];
+
+	if (stat->Count == 0xffff) return;
+
+	if (stat->Count == 0 || cycles < stat->Min) stat->Min = cycles;
+	if (cycles > stat->Max) stat->Max = cycles;
+	stat->Total += cycles;
+	stat->Count++;
+}
+
+// sends an instruction kind's count and its minimum, maximum and mean cycles, fed with kind (0xff clears them all
+// and replies with just the command and 0xff)
+void send_opcode_stats(uint8_t kind)
+{
+	uint8_t reply[16];
+
+	reply[0] = GET_OPCODE_STATS;
+	reply[1] = kind;
+
+	if (kind == 0xff)
+	{
+		for (uint8_t i = 0; i < OP_KINDS; i++)
 		{
-		case '+':
-			result += operand;
+			OPCODE_STAT* stat = &OpcodeStats[i];
+			stat->Count = 0;
+			stat->Total = stat->Min = stat->Max = 0;
+		}
+		SendReply(reply, 2);
+		return;
+	}
+	if (kind >= OP_KINDS) return;
+
+	OPCODE_STAT* stat = &OpcodeStats[kind];
+	uint32_t mean = stat->Count != 0 ? stat->Total / stat->Count : 0;
+	uint32_t min = stat->Count != 0 ? stat->Min : 0;
+
+	reply[2] = (uint8_t) stat->Count;
+	reply[3] = (uint8_t) (stat->Count >> 8);
+	reply[4] = (uint8_t) min;
+	reply[5] = (uint8_t) (min >> 8);
+	reply[6] = (uint8_t) (min >> 16);
+	reply[7] = (uint8_t) (min >> 24);
+	reply[8] = (uint8_t) stat->Max;
+	reply[9] = (uint8_t) (stat->Max >> 8);
+	reply[10] = (uint8_t) (stat->Max >> 16);
+	reply[11] = (uint8_t) (stat->Max >> 24);
+	reply[12] = (uint8_t) mean;
+	reply[13] = (uint8_t) (mean >> 8);
+	reply[14] = (uint8_t) (mean >> 16);
+	reply[15] = (uint8_t) (mean >> 24);
+	SendReply(reply, 16);
+}
+#endif
+
+// displays the tape symbols in view
+void update_tape(void)
+{
+	#define HI_BRIGHTNESS 0x60
+	#define LO_BRIGHTNESS 0x20
+
+	// a batch run can leave the display as it is until it ends
+	if (Batching && (BatchFlags & RUN_HOLD_LEDS)) return;
+
+	uint8_t bucket = CPU_Account(CPU_LEDS);
+	uint16_t start = micros();
+
+	follow_head();
+
+	reset_leds();
+
+	int16_t pos = ViewStart;
+
+	for (uint8_t i = 0; i < NumLeds; i++, pos++)
+	{
+		uint8_t brightness = LO_BRIGHTNESS;
+		if (Settings.TapeheadHighlighting && pos == HeadPosition) brightness = HI_BRIGHTNESS;
+
+		switch (get_symbol(pos))
+		{
+		case 'R':
+			red = brightness; green = blue = 0;
 			break;
-		case '-':
-			result -= operand;
+		case 'G':
+			green = brightness; red = blue = 0;
 			break;
-		case '*':
-			result *= operand;
+		case 'B':
+			blue = brightness; red = green = 0;
 			break;
-		case '/':
-			result /= operand;
+		case 'C':
+			green = blue = brightness; red = 0;
 			break;
-		case '&':
-			result &= operand;
+		case 'M':
+			red = blue = brightness; green = 0;
 			break;
-		case '|':
-			result |= operand;
+		case 'Y':
+			red = green = brightness; blue = 0;
+			break;
+		case 'W':
+			red = green = blue = brightness;
+			break;
+		case 'K':
+			red = green = blue = 0;
+			break;
+		default:
+			red = green = blue = 0;
 			break;
 		}
+
+		set_led();
+	}
+
+	FrameTime = micros() - start;
+	CPU_Account(bucket);
+}
+
+// returns true if two strings match
+bool cmp_strs(char* s1, char* s2)
+{
+	while (true)
+	{
+		if (*s1 == '\0' && *s2 == '\0') return true;
+		if (*s1++ != *s2++) return false;
+	}
+}
+
+// copies a string
+void copy_str(char* s, char* d)
+{
+	char c;
+	do
+	{
+		c = *d++ = *s++;
+	}
+	while (c != '\0');
+}
+
+// empties the decoded instruction cache, needed whenever the program or name arena changes
+void flush_decoded(void)
+{
+	for (uint8_t i = 0; i < DECODE_ENTRIES; i++) DecodeCache[i].Position = -1;
+}
+
+// empties the program cache
+void flush_cache(void)
+{
+	for (uint8_t i = 0; i < CACHE_LINES; i++) CacheTags[i] = -1;
+	flush_decoded();
+}
+
+// returns a character in program, fetching its line from flash if not cached
+char program_char(int16_t pos)
+{
+	int16_t tag = pos / CACHE_LINE;
+	uint8_t line = (uint8_t) tag % CACHE_LINES;
+
+	if (CacheTags[line] != tag)
+	{
+		uint16_t start = (uint16_t) tag * CACHE_LINE;
+		uint8_t row = (uint8_t) (start / ROW_SIZE);
+		uint8_t offset = start % ROW_SIZE;
+		uint8_t* dst = (uint8_t*) ProgramCache[line];
+
+		// the row being loaded may not be in flash yet
+		if (row == LoadRowIndex) for (uint8_t i = 0; i < CACHE_LINE; i++) dst[i] = LoadRow[offset+i];
+		else if (ProgramRows[row] == NO_ROW) for (uint8_t i = 0; i < CACHE_LINE; i++) dst[i] = 0xff;
+		else read_mem(row_address(ProgramRows[row]) + offset, CACHE_LINE, dst);
+
+		CacheTags[line] = tag;
+		CacheMisses++;
+	}
+
+	return ProgramCache[line][pos % CACHE_LINE];
+}
+
+// returns current character in program
+inline char current(void)
+{
+	return ProgramPosition >= ProgramLength ? '\0' : program_char(ProgramPosition);
+}
+
+// steps over current character in program
+inline void step(void)
+{
+	if (ProgramPosition < ProgramLength) ProgramPosition++;
+}
+
+// returns next character in program
+inline char next(void)
+{
+	return ProgramPosition >= ProgramLength ? '\0' : (++ProgramPosition >= ProgramLength ? '\0' : program_char(ProgramPosition));
+}
+
+// returns true if end of program
+inline bool end_of_program(void)
+{
+	return ProgramPosition >= ProgramLength;
+}
+
+// returns true if valid character in label or variable name
+inline bool is_name(char c)
+{
+	return char_class(c) & CC_NAME;
+}
+
+// returns true if interned name token
+inline bool is_token(char c)
+{
+	return (uint8_t) c >= TOKEN_BASE && (uint8_t) c != 0xff;
+}
+
+// returns true if symbol
+inline bool is_symbol(char c)
+{
+	return (char_class(c) & CC_INSTRUCTION) == INS_SET;
+}
+
+// returns true if arithmetic or bitwise operator
+inline bool is_operator(char c)
+{
+	return char_class(c) & CC_OPERATOR;
+}
+
+// returns true if start of expression
+inline bool is_expression(char c)
+{
+	return char_class(c) & CC_EXPRESSION;
+}
+
+// returns true if decimal digit
+inline bool is_digit(char c)
+{
+	return char_class(c) & CC_DIGIT;
+}
+
+// parses a decimal number
+int8_t get_number(void)
+{
+	bool negate = current() == '-';
+	if (negate) step();
+
+	int8_t n = 0;
+	char c;
+	while (is_digit(c = current()))
+	{
+		n = n * 10 + (int8_t) (c - '0');
+		step();
 	}
 
-	// signed 8-bit
-	return (int16_t) (int8_t) result;
+	return negate ? -n : n;
+}
+
+// skips over whitespace and comments, returns true if end of program
+bool skip_space(void)
+{
+	while (true)
+	{
+		char c = current();
+		if (c == ';')
+		{
+			// comment - skip to end of line
+			while (next() != '\0' && current() != '\n') ;
+		}
+		else if (char_class(c) & CC_SPACE)
+		{
+			step();
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	return end_of_program();
+}
+
+// parses a label or variable name into the free end of the name arena
+char* get_name(void)
+{
+	char* name = &Names[NamesUsed+1];
+	uint8_t i = 0;
+
+	skip_space();
+
+	// an interned name is known by its token, spelt out after the token where it first appears
+	bool token = is_token(current());
+	if (token) name[i++] = current(), step();
+
+	while (is_name(current()))
+	{
+		if (i < NAME_LEN && !token) name[i++] = current();
+		step();
+	}
+	name[i] = '\0';
+
+	return name;
+}
+
+// returns the size of a name's value, fed with kind
+inline uint8_t value_size(char kind)
+{
+	return kind == '#' ? sizeof(int16_t) : sizeof(int8_t);
+}
+
+// returns the arena index of the entry following an entry
+uint8_t next_name(uint8_t i)
+{
+	char kind = Names[i++];
+	while (Names[i++] != '\0') ;
+	return i + value_size(kind);
+}
+
+// reads a name as get_name() does but compares it in place, leaving the name fed with where it is,
+// returns true if they match
+bool match_name(char* name)
+{
+	uint8_t i = 0;
+	bool same = true;
+
+	skip_space();
+
+	bool token = is_token(current());
+	if (token) same = current() == name[i++], step();
+
+	while (is_name(current()))
+	{
+		if (i < NAME_LEN && !token && same) same = current() == name[i++];
+		step();
+	}
+
+	return same && name[i] == '\0';
+}
+
+// finds a name, fed with kind and name, returns arena index of value or NO_NAME if not found
+uint8_t find_name(char kind, char* name)
+{
+	for (uint8_t i = 0; i < NamesUsed; )
+	{
+		uint8_t next = next_name(i);
+		if (Names[i] == kind && cmp_strs(&Names[i+1], name)) return next - value_size(kind);
+		i = next;
+	}
+	return NO_NAME;
+}
+
+// adds a name with a zero value, fed with kind and name, returns arena index of value or NO_NAME if full
+uint8_t add_name(char kind, char* name)
+{
+	uint8_t len = 0;
+	while (name[len] != '\0') len++;
+
+	uint8_t size = 1 + len + 1 + value_size(kind);
+	if (NamesUsed + size > NAME_ARENA) return NO_NAME;
+
+	// usually the name is already in place, read there by get_name()
+	Names[NamesUsed] = kind;
+	copy_str(name, &Names[NamesUsed+1]);
+
+	uint8_t ndx = NamesUsed + size - value_size(kind);
+	Names[ndx] = 0;
+	if (kind == '#') Names[ndx+1] = 0;
+
+	NamesUsed += size;
+	return ndx;
+}
+
+// parses an operand (symbol, variable or decimal number), returns ERROR if error
+int16_t get_operand(void)
+{
+	skip_space();
+
+	if (is_symbol(current()))
+	{
+		char symbol = current();
+		step();
+		ExpressionConstant = false;
+		return get_symbol(HeadPosition) == symbol ? 1 : 0;
+	}
+
+	else if (current() == '$')
+	{
+		step();
+		ExpressionConstant = false;
+		uint8_t ndx = find_name('$', get_name());
+		if (ndx != NO_NAME) return (int8_t) Names[ndx];
+		error(ERR_VARIABLE_NOT_FOUND);
+		return ERROR;
+	}
+
+	else if (current() == '-' || is_digit(current()))
+	{
+		return get_number();
+	}
+
+	error(ERR_OPERAND_ERROR);
+	return ERROR;
+}
+
+// parses an expression, returns ERROR if error
+// parentheses can only open an expression, so a bracketed group just hands its value on
+// to the enclosing one, and nesting is tracked with a depth count rather than recursion
+int16_t get_expression(void)
+{
+	uint8_t depth = 0;
+	ExpressionConstant = true;
+
+	skip_space();
+	while (current() == '(')
+	{
+		if (depth == MAX_NESTING)
+		{
+			error(ERR_NESTING_TOO_DEEP);
+			return ERROR;
+		}
+		depth++;
+		step();
+		skip_space();
+	}
+
+	int16_t result = get_operand();
+	if (result == ERROR) return ERROR;
+
+	while (true)
+	{
+		skip_space();
+
+		char op = current();
+		if (op == ')')
+		{
+			// closing parenthesis at top level ends the expression, it belongs to the caller
+			if (depth == 0) break;
+			depth--;
+			step();
+			result = (int8_t) result;
+			continue;
+		}
+
+		if (!is_operator(op)) break;
+
+		step();
+
+		int16_t operand = get_operand();
+		if (operand == ERROR) return ERROR;
+
+		switch (op)
+		{
+		case '+':
+			result += operand;
+			break;
+		case '-':
+			result -= operand;
+			break;
+		case '*':
+			result *= operand;
+			break;
+		case '/':
+			result /= operand;
+			break;
+		case '&':
+			result &= operand;
+			break;
+		case '|':
+			result |= operand;
+			break;
+		}
+	}
+
+	// unclosed parenthesis
+	if (depth != 0) return ERROR;
+
+	// signed 8-bit
+	return (int16_t) (int8_t) result;
+}
+
+
+//**************************************************************************
+// Turing Machine functions
+//**************************************************************************
+
+// parses an instruction's expression, noting for the decoded instruction its value if constant or else where it starts
+int16_t decode_expression(void)
+{
+	int16_t start = ProgramPosition;
+	int16_t x = get_expression();
+
+	if (!ExpressionConstant)
+	{
+		Decoding->Kind = DEC_EXPRESSION;
+		Decoding->Value = start;
+	}
+
+	return x;
+}
+
+// notes an instruction just executed in the decoded instruction cache, fed with kind and constant value
+void decoded(uint8_t kind, int16_t value)
+{
+	if (!(Decoding->Kind & DEC_EXPRESSION)) Decoding->Value = value;
+	Decoding->Kind |= kind;
+	Decoding->Next = ProgramPosition;
+}
+
+// moves the tape head, fed with mode and distance
+void move_head(uint8_t mode, int16_t n)
+{
+	switch (mode)
+	{
+	case MOVE_FIRST:
+		HeadPosition = 0;
+		break;
+	case MOVE_LAST:
+		HeadPosition = (int16_t) Settings.TapeLength - 1;
+		break;
+	case MOVE_BACK:
+		HeadPosition -= (int8_t) n;
+		break;
+	case MOVE_FORWARD:
+		HeadPosition += (int8_t) n;
+		break;
+	}
+
+	// allow one square off tape
+	if (HeadPosition < 0) HeadPosition = -1;
+	else if (HeadPosition >= (int16_t) Settings.TapeLength) HeadPosition = (int16_t) Settings.TapeLength;
+}
+
+// handles <, <n, <<, >, >n, >>
+void do_movement(void)
+{
+	uint8_t mode;
+	int16_t n = 1;
+
+	if (current() == '<')
+	{
+		// first square
+		if (next() == '<') step(), mode = MOVE_FIRST;
+		else mode = MOVE_BACK;
+	}
+	else
+	{
+		// last square
+		if (next() == '>') step(), mode = MOVE_LAST;
+		else mode = MOVE_FORWARD;
+	}
+
+	if (mode >= MOVE_BACK && is_expression(current()))
+	{
+		n = decode_expression();
+		if (n == ERROR) return;
+	}
+
+	decoded(INS_MOVEMENT | mode, n);
+	if (Speculating) return;
+
+	move_head(mode, n);
+}
+
+void skip_movement(void)
+{
+	if (current() == '<')
+	{
+		if (next() == '<') step();
+		else if (is_expression(current())) get_expression();
+	}
+
+	else if (current() == '>')
+	{
+		if (next() == '>') step();
+		else if (is_expression(current())) get_expression();
+	}
+}
+
+// assigns a variable, fed with mode, arena index of the variable and value
+void assign(uint8_t mode, uint8_t ndx, int16_t x)
+{
+	int8_t* value = (int8_t*) &Names[ndx];
+
+	switch (mode)
+	{
+	case ASSIGN_INC:
+		if (*value < 127) (*value)++;
+		break;
+	case ASSIGN_DEC:
+		if (*value > -128) (*value)--;
+		break;
+	case ASSIGN_SET:
+		*value = (int8_t) x;
+		break;
+	}
+
+	TraceVariable = ndx;
+}
+
+// handles assignments
+void do_assignment(void)
+{
+	step();
+	char* variable = get_name();
+	uint8_t ndx = find_name('$', variable);
+	if (ndx == NO_NAME)
+	{
+		// a variable only comes into being when its assignment runs
+		if (Speculating) return;
+
+		ndx = add_name('$', variable);
+		if (ndx == NO_NAME)
+		{
+			error(ERR_TOO_MANY_NAMES);
+			return;
+		}
+	}
+
+	skip_space();
+
+	uint8_t mode;
+	int16_t x = 0;
+
+	if (current() == '+')
+	{
+		if (next() != '+')
+		{
+			error(ERR_SYNTAX_ERROR);
+			return;
+		}
+		step();
+		mode = ASSIGN_INC;
+	}
+
+	else if (current() == '-')
+	{
+		if (next() != '-')
+		{
+			error(ERR_SYNTAX_ERROR);
+			return;
+		}
+		step();
+		mode = ASSIGN_DEC;
+	}
+
+	else if (current() == '=')
+	{
+		step();
+		x = decode_expression();
+		if (x == ERROR) return;
+		mode = ASSIGN_SET;
+	}
+
+	else
+	{
+		error(ERR_SYNTAX_ERROR);
+		return;
+	}
+
+	decoded(INS_ASSIGNMENT | mode, x);
+	Decoding->Extra = ndx;
+	if (Speculating) return;
+
+	assign(mode, ndx, x);
+}
+
+void skip_assignment(void)
+{
+	step();
+	get_name();
+
+	skip_space();
+
+	if (current() == '+')
+	{
+		if (next() == '+') step();
+	}
+
+	else if (current() == '-')
+	{
+		if (next() == '-') step();
+	}
+
+	else if (current() == '=')
+	{
+		step();
+		get_expression();
+	}
+}
+
+// returns the outcome of a conditional, fed with mode and value tested
+bool test_condition(uint8_t mode, int16_t x)
+{
+	switch (mode)
+	{
+	case TEST_ZERO:
+		return x == 0;
+	case TEST_POSITIVE:
+		return x > 0;
+	case TEST_NOT_NEGATIVE:
+		return x >= 0;
+	case TEST_NEGATIVE:
+		return x < 0;
+	case TEST_NOT_POSITIVE:
+		return x <= 0;
+	}
+	return x != 0;
+}
+
+// handles conditionals
+void do_conditional(void)
+{
+	uint8_t mode;
+
+	if (next() == '!')
+	{
+		step();
+		mode = TEST_ZERO;
+	}
+
+	else if (current() == '>')
+	{
+		if (next() == '=') step(), mode = TEST_NOT_NEGATIVE;
+		else mode = TEST_POSITIVE;
+	}
+
+	else if (current() == '<')
+	{
+		if (next() == '=') step(), mode = TEST_NOT_POSITIVE;
+		else mode = TEST_NEGATIVE;
+	}
+
+	else
+	{
+		mode = TEST_NOT_ZERO;
+	}
+
+	int16_t x = decode_expression();
+	if (x == ERROR) return;
+
+	// the decoded conditional also knows where the instruction it guards ends, found speculatively
+	// if the instruction is about to run so its errors are left for when it does
+	bool test = test_condition(mode, x);
+	bool speculating = Speculating;
+	int16_t end = ProgramPosition;
+
+	Speculating = speculating || test;
+	SpeculationFailed = false;
+	skip_space();
+	skip_instruction();
+	Speculating = speculating;
+
+	Decoding->Extra = ProgramPosition;
+	ProgramPosition = end;
+	if (!SpeculationFailed) decoded(INS_CONDITIONAL | mode, x);
+	if (Speculating) return;
+
+	if (!test) ProgramPosition = Decoding->Extra;
+}
+
+void skip_conditional(void)
+{
+	if (next() == '!')
+	{
+		step();
+	}
+	else if (current() == '>')
+	{
+		if (next() == '=') step();
+	}
+	else if (current() == '<')
+	{
+		if (next() == '=') step();
+	}
+	get_expression();
+
+	skip_space();
+	skip_instruction();
+}
+
+// carries on searching for a branch's label from the program position until found or out of budget
+void find_label(void)
+{
+	char* label = &Names[LabelUsed+1];
+
+	while (StepBudget != 0)
+	{
+		StepBudget--;
+
+		char c = current();
+		if (c == '\0')
+		{
+			NamesUsed = LabelUsed;
+			error(ERR_LABEL_NOT_FOUND);
+			return;
+		}
+
+		// labels in comments don't count
+		if (InComment)
+		{
+			if (c == '\n') InComment = false;
+			else step();
+		}
+		else if (c != '#')
+		{
+			if (c == ';') InComment = true;
+			step();
+		}
+		else
+		{
+			step();
+			if (match_name(label))
+			{
+				if (LabelValue != NO_NAME)
+				{
+					Names[LabelValue] = (char) ProgramPosition;
+					Names[LabelValue+1] = (char) (ProgramPosition >> 8);
+				}
+				decoded(INS_BRANCH, 0);
+				StepState = STEP_DECODE;
+				return;
+			}
+		}
+	}
+}
+
+// handles branches
+void do_branch(void)
+{
+	step();
+	char* label = get_name();
+	uint8_t ndx = find_name('#', label);
+
+	// the first branch to a label finds it and remembers where it is
+	if (ndx == NO_NAME)
+	{
+		if (Speculating) return;
+
+		// with the arena full the label stays just past its end and is only searched for, not remembered
+		uint8_t used = NamesUsed;
+		ndx = add_name('#', label);
+
+		// the search may take several passes
+		LabelUsed = used;
+		LabelValue = ndx;
+		ProgramPosition = 0;
+		InComment = false;
+		StepState = STEP_LABEL;
+		find_label();
+		return;
+	}
+
+	ProgramPosition = (int16_t) ((uint8_t) Names[ndx] | (uint16_t) (uint8_t) Names[ndx+1] << 8);
+	decoded(INS_BRANCH, 0);
+}
+
+void skip_branch(void)
+{
+	step();
+	get_name();
+}
+
+// sets the wait periods, 0 halts
+void set_wait(int16_t n)
+{
+	WaitPeriods = (int8_t) n;
+	if (WaitPeriods == 0) WaitPeriods = -1;
+}
+
+// handles waits
+void do_wait(void)
+{
+	int16_t n = 1;
+
+	if (is_expression(next()))
+	{
+		n = decode_expression();
+		if (n == ERROR)
+		{
+			if (!Speculating) WaitPeriods = 1;
+			return;
+		}
+	}
+
+	decoded(INS_WAIT, n);
+	if (Speculating) return;
+
+	set_wait(n);
+}
+
+void skip_wait(void)
+{
+	if (is_expression(next())) get_expression();
+}
+
+// handles R, G, B, C, M, Y, W, K
+void do_set(void)
+{
+	char symbol = current();
+	step();
+	decoded(INS_SET, symbol);
+	if (Speculating) return;
+
+	set_symbol(HeadPosition, symbol);
+}
+
+void skip_set(void)
+{
+	step();
+}
+
+// handles the next instruction, dispatched on the class of its first character
+void do_instruction(void)
+{
+	switch (char_class(current()) & CC_INSTRUCTION)
+	{
+	case INS_MOVEMENT:
+		do_movement();
+		break;
+	case INS_ASSIGNMENT:
+		do_assignment();
+		break;
+	case INS_CONDITIONAL:
+		do_conditional();
+		break;
+	case INS_BRANCH:
+		do_branch();
+		break;
+	case INS_WAIT:
+		do_wait();
+		break;
+	case INS_SET:
+		do_set();
+		break;
+	default:
+		error(ERR_INSTRUCTION_ERROR);
+		break;
+	}
+}
+
+// skips over the next instruction
+void skip_instruction(void)
+{
+	switch (char_class(current()) & CC_INSTRUCTION)
+	{
+	case INS_MOVEMENT:
+		skip_movement();
+		break;
+	case INS_ASSIGNMENT:
+		skip_assignment();
+		break;
+	case INS_CONDITIONAL:
+		skip_conditional();
+		break;
+	case INS_BRANCH:
+		skip_branch();
+		break;
+	case INS_WAIT:
+		skip_wait();
+		break;
+	case INS_SET:
+		skip_set();
+		break;
+	}
+}
+
+// steps over whitespace, comments and labels to the next instruction, returns false if out of budget first
+bool seek_instruction(void)
+{
+	while (StepBudget != 0)
+	{
+		StepBudget--;
+
+		char c = current();
+		if (InComment)
+		{
+			if (c == '\n' || c == '\0') InComment = false;
+			else step();
+		}
+		else if (c == ';')
+		{
+			InComment = true;
+			step();
+		}
+		else if (char_class(c) & CC_SPACE)
+		{
+			step();
+		}
+		else if (c == '#')
+		{
+			step();
+			get_name();
+		}
+		else
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// executes an instruction from the decoded instruction cache
+void do_decoded(DECODED* d)
+{
+	int16_t x = d->Value;
+
+	if (d->Kind & DEC_EXPRESSION)
+	{
+		ProgramPosition = x;
+		x = get_expression();
+		if (x == ERROR) return;
+	}
+
+	ProgramPosition = d->Next;
+
+	uint8_t mode = d->Kind & DEC_MODE;
+	switch (d->Kind & DEC_INSTRUCTION)
+	{
+	case INS_MOVEMENT:
+		move_head(mode, x);
+		break;
+	case INS_ASSIGNMENT:
+		assign(mode, (uint8_t) d->Extra, x);
+		break;
+	case INS_CONDITIONAL:
+		if (!test_condition(mode, x)) ProgramPosition = d->Extra;
+		break;
+	case INS_WAIT:
+		set_wait(x);
+		break;
+	case INS_SET:
+		set_symbol(HeadPosition, (char) x);
+		break;
+	}
+}
+
+
+//**************************************************************************
+// executive functions
+//**************************************************************************
+
+#if defined(TRACE)
+// returns the length of a trace record, fed with its header
+uint8_t trace_length(uint8_t header)
+{
+	uint8_t len = 3;
+
+	if (header & TR_POSITION) len++;
+	if (header & TR_HEAD) len++;
+	if (header & TR_VARIABLE) len += 2;
+	if (header & TR_TICKS) len++;
+
+	return len;
+}
+
+// returns a byte of the trace, fed with its offset from the oldest record
+uint8_t trace_byte(uint8_t offset)
+{
+	return Trace[(uint8_t) (TraceTail + offset) & TRACE_MASK];
+}
+
+// drops the oldest trace record, the state it changes becomes the state it leaves
+void drop_trace(void)
+{
+	uint8_t header = trace_byte(0);
+	uint8_t n = 1;
+
+	if (header & TR_POSITION)
+	{
+		TraceBasePosition = (int16_t) (trace_byte(1) | (uint16_t) trace_byte(2) << 8);
+		n += 2;
+	}
+	else
+	{
+		TraceBasePosition += (int8_t) trace_byte(n++);
+	}
+
+	if (header & TR_HEAD) TraceBaseHead = trace_byte(n++);
+	if (header & TR_VARIABLE) n += 2;
+
+	uint16_t ticks = trace_byte(n++);
+	if (header & TR_TICKS) ticks |= (uint16_t) trace_byte(n++) << 8;
+	TraceBaseTicks += ticks;
+
+	TraceTail = (uint8_t) (TraceTail + n) & TRACE_MASK;
+	TraceUsed -= n;
+}
+
+// adds a byte to the newest trace record
+void put_trace(uint8_t b)
+{
+	Trace[(uint8_t) (TraceTail + TraceUsed) & TRACE_MASK] = b;
+	TraceUsed++;
+}
+
+// returns the first byte of a variable's name, its token once interned, fed with the arena index of its value
+// (the host knows tokens from the program it loaded, not where the arena put them)
+uint8_t variable_token(uint8_t ndx)
+{
+	uint8_t i = 0;
+	while (Names[i] != '$' || next_name(i) - sizeof(int8_t) != ndx) i = next_name(i);
+	return (uint8_t) Names[i+1];
+}
+
+// records the step just run in the trace, fed with the program position it started from
+void trace_step(int16_t pos)
+{
+	uint16_t now = get_ticks();
+	uint16_t ticks = now - TraceTicks;
+	int16_t change = pos - TracePosition;
+	uint8_t head = (uint8_t) HeadPosition;
+
+	uint8_t header = 0;
+	if (TraceSymbol != NO_SYMBOL) header |= TR_SYMBOL | TraceSymbol;
+	if (change < -128 || change > 127) header |= TR_POSITION;
+	if (head != TraceHead) header |= TR_HEAD;
+	if (TraceVariable != NO_NAME) header |= TR_VARIABLE;
+	if (ticks > 0xff) header |= TR_TICKS;
+
+	// the oldest records make way
+	uint8_t len = trace_length(header);
+	while (TRACE_BYTES - TraceUsed < len) drop_trace();
+
+	put_trace(header);
+	if (header & TR_POSITION) put_trace((uint8_t) pos), put_trace((uint8_t) (pos >> 8));
+	else put_trace((uint8_t) change);
+	if (header & TR_HEAD) put_trace(head);
+	if (header & TR_VARIABLE) put_trace(variable_token(TraceVariable)), put_trace((uint8_t) Names[TraceVariable]);
+	put_trace((uint8_t) ticks);
+	if (header & TR_TICKS) put_trace((uint8_t) (ticks >> 8));
+
+	TracePosition = pos;
+	TraceHead = head;
+	TraceTicks = now;
+}
+
+// sends the trace, a header with the bytes in use, the state the oldest record changes and the last error, then
+// the records oldest first, filling the header's reply and as many more as they take (two at most, so the one
+// being sent and the one queued hold the whole trace)
+void send_trace(void)
+{
+	uint8_t reply[64];
+
+	reply[0] = GET_TRACE;
+	reply[1] = 0;
+	reply[2] = TraceUsed;
+	reply[3] = (uint8_t) TraceBasePosition;
+	reply[4] = (uint8_t) (TraceBasePosition >> 8);
+	reply[5] = TraceBaseHead;
+	reply[6] = (uint8_t) TraceBaseTicks;
+	reply[7] = (uint8_t) (TraceBaseTicks >> 8);
+	reply[8] = TraceError;
+
+	uint8_t n = 9;
+	uint8_t offset = 0;
+	for (uint8_t seq = 1; ; seq++)
+	{
+		while (offset < TraceUsed && n < sizeof(reply)) reply[n++] = trace_byte(offset++);
+		SendReply(reply, n);
+		if (offset >= TraceUsed) return;
+
+		n = 2;
+		reply[1] = seq;
+	}
+}
+#endif
+
+// returns the step period in ticks, never shorter than a frame takes to display
+uint16_t step_period(void)
+{
+	uint16_t period = 1000 / Settings.ClockSpeed;
+	uint16_t frame = FrameTime / 1000 + 1;
+
+	return period > frame ? period : frame;
+}
+
+void StartTuring(void)
+{
+	TimerCnt = step_period();
+	TimerEnabled = true;
+}
+
+void StopTuring(void)
+{
+	TimerEnabled = false;
+}
+
+// returns a hash of the machine state, Fletcher's checksum over the tape, head, program position and name arena
+uint32_t state_hash(void)
+{
+	uint16_t sum1 = 0, sum2 = 0;
+
+	for (uint8_t i = 0; i < TAPE_BYTES; i++) sum1 += Tape[i], sum2 += sum1;
+	for (uint8_t i = 0; i < NamesUsed; i++) sum1 += (uint8_t) Names[i], sum2 += sum1;
+	sum1 += (uint16_t) HeadPosition, sum2 += sum1;
+	sum1 += (uint16_t) ProgramPosition, sum2 += sum1;
+	sum1 += NamesUsed, sum2 += sum1;
+
+	return (uint32_t) sum2 << 16 | sum1;
+}
+
+// restarts cycle detection from the current state
+void reset_cycle(void)
+{
+	CycleHash = state_hash();
+	CycleSteps = 0;
+	CyclePower = 1;
+	CycleWaited = false;
+	CycleLength = 0;
+}
+
+// checks for a cycle after a step using Brent's algorithm, parking the machine once a cycle without waits
+// is confirmed by a second lap arriving back at the same state
+void cycle_task(void)
+{
+	if (WaitPeriods != 0) CycleWaited = true;
+
+	uint32_t hash = state_hash();
+
+	if (CycleLength != 0)
+	{
+		if (--CycleConfirm != 0) return;
+
+		if (hash == CycleHash && !CycleWaited)
+		{
+			// parked, the display stays as it is and the host reads the cycle length
+			StopTuring();
+			return;
+		}
+		reset_cycle();
+		return;
+	}
+
+	CycleSteps++;
+	if (hash == CycleHash && !CycleWaited)
+	{
+		CycleLength = CycleConfirm = CycleSteps;
+		return;
+	}
+
+	if (CycleSteps == CyclePower)
+	{
+		CycleHash = hash;
+		CycleSteps = 0;
+		if (CyclePower < CYCLE_POWER_MAX) CyclePower <<= 1;
+		CycleWaited = false;
+	}
+}
+
+// notes whether any breakpoint or watchpoint is set
+void arm_debug(void)
+{
+	DebugArmed = WatchName[0] != '\0' || WatchSquare >= 0;
+	for (uint8_t i = 0; i < NUM_BREAKPOINTS; i++) if (Breakpoints[i] >= 0) DebugArmed = true;
+}
+
+// returns the token a name was interned as, fed with name, or 0 if the name is spelt out in the arena
+char name_token(char* name)
+{
+	uint8_t token = TOKEN_BASE;
+
+	// tokens first appear in order, each followed by its name
+	for (int16_t pos = 0; pos < (int16_t) ProgramLength; pos++)
+	{
+		if ((uint8_t) program_char(pos) != token) continue;
+
+		uint8_t i;
+		for (i = 0; name[i] != '\0'; i++) if (program_char(pos + 1 + i) != name[i]) break;
+		if (name[i] == '\0' && !is_name(program_char(pos + 1 + i))) return (char) token;
+
+		token++;
+	}
+
+	return 0;
+}
+
+// watches from the machine state as it is, a variable already in being from its current value
+void sync_watch(void)
+{
+	WatchVariable = WatchName[0] != '\0' ? find_name('$', WatchName) : NO_NAME;
+	if (WatchVariable != NO_NAME) WatchValue = (int8_t) Names[WatchVariable];
+
+	if (WatchSquare >= 0) WatchSymbol = get_symbol(WatchSquare);
+}
+
+// watches a variable, fed with its name and length (0 to stop watching)
+void watch_variable(uint8_t* name, uint8_t len)
+{
+	if (len > NAME_LEN) len = NAME_LEN;
+	for (uint8_t i = 0; i < len; i++) WatchName[i] = (char) name[i];
+	WatchName[len] = '\0';
+
+	if (len > 0)
+	{
+		char token = name_token(WatchName);
+		if (token != 0) WatchName[0] = token, WatchName[1] = '\0';
+	}
+
+	sync_watch();
+	arm_debug();
+}
+
+// watches a tape square, fed with square (-1 to stop watching)
+void watch_square(int16_t pos)
+{
+	WatchSquare = pos;
+
+	sync_watch();
+	arm_debug();
+}
+
+// stops the machine at a breakpoint or watchpoint, telling the host which, where the program and head are and the
+// state hash, fed with the command that set it and which one
+void debug_stop(uint8_t command, uint8_t which)
+{
+	uint8_t reply[10];
+
+	StopTuring();
+
+	uint32_t hash = state_hash();
+
+	reply[0] = command;
+	reply[1] = which;
+	reply[2] = (uint8_t) ProgramPosition;
+	reply[3] = (uint8_t) (ProgramPosition >> 8);
+	reply[4] = (uint8_t) HeadPosition;
+	reply[5] = (uint8_t) (HeadPosition >> 8);
+	reply[6] = (uint8_t) hash;
+	reply[7] = (uint8_t) (hash >> 8);
+	reply[8] = (uint8_t) (hash >> 16);
+	reply[9] = (uint8_t) (hash >> 24);
+	SendReply(reply, 10);
+}
+
+// checks breakpoints and watchpoints after a step
+void debug_task(void)
+{
+	for (uint8_t i = 0; i < NUM_BREAKPOINTS; i++)
+	{
+		if (ProgramPosition == Breakpoints[i])
+		{
+			debug_stop(SET_BREAKPOINT, i);
+			return;
+		}
+	}
+
+	// the watched variable is known once a step assigns it
+	if (TraceVariable != NO_NAME && WatchName[0] != '\0')
+	{
+		if (WatchVariable == NO_NAME && find_name('$', WatchName) == TraceVariable) WatchVariable = TraceVariable, WatchValue = 0;
+
+		if (TraceVariable == WatchVariable && (int8_t) Names[WatchVariable] != WatchValue)
+		{
+			WatchValue = (int8_t) Names[WatchVariable];
+			debug_stop(SET_WATCH, WATCH_VARIABLE);
+			return;
+		}
+	}
+
+	if (WatchSquare >= 0)
+	{
+		char symbol = get_symbol(WatchSquare);
+		if (symbol != WatchSymbol)
+		{
+			WatchSymbol = symbol;
+			debug_stop(SET_WATCH, WATCH_SQUARE);
+		}
+	}
+}
+
+// ends a batch run, replying with why it ended, the steps run, ticks taken, state hash and program position
+void end_batch(uint8_t reason)
+{
+	uint8_t reply[16];
+
+	BatchTicks += (uint16_t) (get_ticks() - BatchPrevTicks);
+	Batching = false;
+
+	// a machine that was stopped stays stopped, one that stopped itself stays that way too
+	if (!BatchTimer) StopTuring();
+	update_tape();
+
+	uint32_t hash = state_hash();
+
+	reply[0] = RUN_STEPS;
+	reply[1] = reason;
+	reply[2] = (uint8_t) BatchSteps;
+	reply[3] = (uint8_t) (BatchSteps >> 8);
+	reply[4] = (uint8_t) (BatchSteps >> 16);
+	reply[5] = (uint8_t) (BatchSteps >> 24);
+	reply[6] = (uint8_t) BatchTicks;
+	reply[7] = (uint8_t) (BatchTicks >> 8);
+	reply[8] = (uint8_t) (BatchTicks >> 16);
+	reply[9] = (uint8_t) (BatchTicks >> 24);
+	reply[10] = (uint8_t) hash;
+	reply[11] = (uint8_t) (hash >> 8);
+	reply[12] = (uint8_t) (hash >> 16);
+	reply[13] = (uint8_t) (hash >> 24);
+	reply[14] = (uint8_t) ProgramPosition;
+	reply[15] = (uint8_t) (ProgramPosition >> 8);
+	SendReply(reply, 16);
+}
+
+// starts running steps back to back, fed with step count (0 for no limit), position to stop at (-1 for none) and options
+void start_batch(uint16_t steps, int16_t stop, uint8_t flags)
+{
+	if (Batching) end_batch(BATCH_ABORTED);
+
+	BatchLimit = steps;
+	BatchStop = stop;
+	BatchFlags = flags;
+	BatchTimer = TimerEnabled;
+	BatchSteps = 0;
+	BatchTicks = 0;
+	BatchPrevTicks = get_ticks();
+	Batching = true;
+
+	// the machine runs, so the end of the program or an error stops it as usual
+	StartTuring();
+}
+
+// machine state regions making up the checkpoint image
+const struct
+{
+	uint8_t* Data;
+	uint8_t Size;
+}
+CheckpointImage[] =
+{
+	{(uint8_t*) Tape, sizeof(Tape)},
+	{(uint8_t*) &HeadPosition, sizeof(HeadPosition)},
+	{(uint8_t*) &ProgramPosition, sizeof(ProgramPosition)},
+	{(uint8_t*) &WaitPeriods, sizeof(WaitPeriods)},
+	{(uint8_t*) Names, NAME_ARENA},
+	{(uint8_t*) &NamesUsed, sizeof(NamesUsed)},
+	{(uint8_t*) &TimerEnabled, sizeof(TimerEnabled)}
+};
+
+// checkpoint commit row, written last so a set only counts once all its data rows are in flash
+typedef struct
+{
+	uint8_t Slot;
+	uint16_t Length;
+	uint16_t Sequences[CHECKPOINT_ROWS];
 }
+CHECKPOINT_COMMIT;
 
+// copies a row of the checkpoint image to or from a buffer, fed with row number, buffer pointer and direction
+void checkpoint_image(uint8_t ndx, uint8_t* buf, bool save)
+{
+	uint16_t start = (uint16_t) ndx * ROW_SIZE;
+	uint16_t offset = 0;
 
-//**************************************************************************
-// Turing Machine functions
-//**************************************************************************
+	if (save) for (uint8_t i = 0; i < ROW_SIZE; i++) buf[i] = 0xff;
 
-// handles <, <n, <<, >, >n, >>
-void do_movement(void)
-{
-	if (current() == '<')
+	for (uint8_t i = 0; i < sizeof(CheckpointImage)/sizeof(CheckpointImage[0]); i++)
 	{
-		if (next() == '<')
-		{
-			step();
-			// first square
-			HeadPosition = 0;
-		}
-		else if (is_expression(current()))
-		{
-			int16_t n = get_expression();
-			if (n == ERROR) return;
-			HeadPosition -= (int8_t) n;
-		}
-		else
+		uint8_t* p = CheckpointImage[i].Data;
+
+		for (uint8_t j = 0; j < CheckpointImage[i].Size; j++, offset++)
 		{
-			HeadPosition--;
+			if (offset < start || offset >= start + ROW_SIZE) continue;
+			if (save) buf[offset-start] = p[j];
+			else p[j] = buf[offset-start];
 		}
 	}
+}
 
-	else if (current() == '>')
+// starts a checkpoint, written a row a tick by checkpoint_task()
+void start_checkpoint(void)
+{
+	// a step part way through would save a program position in the middle of its text
+	if (CheckpointRow >= 0 || ProgramLength == 0 || LoadRowIndex >= 0 || StepState != STEP_IDLE) return;
+
+	CheckpointRow = 0;
+	CheckpointMs = 0;
+	CheckpointSecs = 0;
+}
+
+// writes the next row of a checkpoint in progress, only rows that have changed reach flash
+void checkpoint_task(void)
+{
+	if (CheckpointRow < 0) return;
+
+	// rows are staged in the load row, so a load abandons the checkpoint
+	if (LoadRowIndex >= 0)
 	{
-		if (next() == '>')
-		{
-			step();
-			// last square
-			HeadPosition = NUM_SQUARES-1;
-		}
-		else if (is_expression(current()))
-		{
-			int16_t n = get_expression();
-			if (n == ERROR) return;
-			HeadPosition += (int8_t) n;
-		}
-		else
+		CheckpointRow = -1;
+		return;
+	}
+
+	// a row is erased a tick ahead of being written, as the background store does
+	if (!ready_row()) return;
+
+	uint8_t ndx = (uint8_t) CheckpointRow;
+	uint8_t* rows = CheckpointRows[CheckpointSet];
+
+	if (ndx < CHECKPOINT_ROWS)
+	{
+		checkpoint_image(ndx, LoadRow, true);
+	}
+	else
+	{
+		// commit the set by recording the sequence number of every data row
+		CHECKPOINT_COMMIT* commit = (CHECKPOINT_COMMIT*) LoadRow;
+		ROW_HEADER header;
+
+		for (uint8_t i = 0; i < ROW_SIZE; i++) LoadRow[i] = 0xff;
+		commit->Slot = Settings.ActiveSlot;
+		commit->Length = ProgramLength;
+		for (uint8_t i = 0; i < CHECKPOINT_ROWS; i++)
 		{
-			HeadPosition++;
+			read_header(rows[i], &header);
+			commit->Sequences[i] = header.Sequence;
 		}
 	}
 
-	// allow one square off tape
-	if (HeadPosition < 0) HeadPosition = -1;
-	else if (HeadPosition >= NUM_SQUARES) HeadPosition = NUM_SQUARES;
-}
-
-void skip_movement(void)
-{
-	if (current() == '<')
+	// a full store abandons the checkpoint quietly, the other set still holds the last one
+	uint8_t row = store_row(AREA_CHECKPOINT + CheckpointSet, ndx, rows[ndx], LoadRow);
+	if (row == NO_ROW)
 	{
-		if (next() == '<') step();
-		else if (is_expression(current())) get_expression();
+		CheckpointRow = -1;
+		return;
 	}
+	rows[ndx] = row;
 
-	else if (current() == '>')
+	if (++CheckpointRow > (int8_t) CHECKPOINT_ROWS)
 	{
-		if (next() == '>') step();
-		else if (is_expression(current())) get_expression();
+		CheckpointRow = -1;
+		CheckpointSet ^= 1;
 	}
 }
 
-// handles assignments
-void do_assignment(void)
+// releases both checkpoint sets, erased in the background commit rows first
+void discard_checkpoints(void)
 {
-	step();
-	char* variable = get_name();
-	int8_t ndx = find_variable(variable);
-	if (ndx == -1)
+	CheckpointRow = -1;
+
+	for (uint8_t set = 0; set < 2; set++)
 	{
-		ndx = add_variable(variable, 0);
-		if (ndx == -1)
+		for (uint8_t i = 0; i < CHECKPOINT_ROWS+1; i++)
 		{
-			error(ERR_TOO_MANY_VARIABLES);
-			return;
+			mark_obsolete(CheckpointRows[set][i]);
+			CheckpointRows[set][i] = NO_ROW;
 		}
 	}
+}
 
-	skip_space();
+// restores the newest checkpoint taken of the mounted program, returns false if none
+bool resume_checkpoint(void)
+{
+	CHECKPOINT_COMMIT commit;
+	ROW_HEADER header;
+	int8_t newest = -1;
+	uint16_t sequence = 0;
 
-	if (current() == '+')
+	for (uint8_t set = 0; set < 2; set++)
 	{
-		if (next() == '+')
+		uint8_t* rows = CheckpointRows[set];
+		if (rows[CHECKPOINT_ROWS] == NO_ROW) continue;
+
+		read_mem(row_address(rows[CHECKPOINT_ROWS]), sizeof(commit), (uint8_t*) &commit);
+		if (commit.Slot != Settings.ActiveSlot || commit.Length != ProgramLength) continue;
+
+		// a set interrupted part way through has data rows newer than its commit row
+		uint8_t i;
+		for (i = 0; i < CHECKPOINT_ROWS; i++)
 		{
-			step();
-			if (VariableValues[ndx] < 127) VariableValues[ndx]++;
-			return;
+			if (rows[i] == NO_ROW) break;
+			read_header(rows[i], &header);
+			if (header.Sequence != commit.Sequences[i]) break;
 		}
-	}
+		if (i < CHECKPOINT_ROWS) continue;
 
-	else if (current() == '-')
-	{
-		if (next() == '-')
+		read_header(rows[CHECKPOINT_ROWS], &header);
+		if (newest < 0 || (int16_t) (header.Sequence - sequence) > 0)
 		{
-			step();
-			if (VariableValues[ndx] > -128) VariableValues[ndx]--;
-			return;
+			newest = (int8_t) set;
+			sequence = header.Sequence;
 		}
 	}
 
-	else if (current() == '=')
+	if (newest < 0) return false;
+
+	for (uint8_t i = 0; i < CHECKPOINT_ROWS; i++)
 	{
-		step();
-		int16_t x = get_expression();
-		if (x == ERROR) return;
-		VariableValues[ndx] = (int8_t) x;
-		return;
+		read_mem(row_address(CheckpointRows[newest][i]), ROW_SIZE, RowData);
+		checkpoint_image(i, RowData, false);
 	}
 
-	error(ERR_SYNTAX_ERROR);
+	// the next checkpoint overwrites the older set
+	CheckpointSet = (uint8_t) (newest ^ 1);
+
+	// decoded instructions may refer to variables that were not in the saved arena
+	flush_decoded();
+	reset_cycle();
+	sync_watch();
+
+	update_tape();
+
+	return true;
 }
 
-void skip_assignment(void)
+// resets the Turing Machine
+void ResetTuring(void)
 {
-	step();
-	get_name();
+	// a batch run ends with the run it belongs to
+	if (Batching) end_batch(BATCH_ABORTED);
 
-	skip_space();
+	StopTuring();
 
-	if (current() == '+')
+	// checkpoints belong to the run being abandoned
+	discard_checkpoints();
+
+	// leftmost square
+	HeadPosition = 0;
+
+	// start of program
+	ProgramPosition = 0;
+
+	// no wait
+	WaitPeriods = 0;
+
+	// reset timer
+	TimerCnt = step_period();
+
+	// clear symbols
+	for (uint8_t i = 0; i < TAPE_BYTES; i++) Tape[i] = 0;
+
+	// clear variables and labels
+	NamesUsed = 0;
+	flush_decoded();
+
+	// abandon a step in progress
+	StepState = STEP_IDLE;
+	MaxStepTime = 0;
+
+	// look for cycles afresh
+	reset_cycle();
+
+	// watches start from the cleared machine
+	sync_watch();
+
+	// update LEDs
+	update_tape();
+}
+
+// decodes the instruction a step from a program position would run, without running it, fed with position
+void predecode(int16_t pos)
+{
+	DECODED* d = &DecodeCache[(uint8_t) pos % DECODE_ENTRIES];
+
+	// already decoded, or the slot holds the next step's instruction
+	if (d->Position == pos || d->Position == ProgramPosition) return;
+
+	int16_t position = ProgramPosition;
+	ProgramPosition = pos;
+	StepBudget = STEP_BUDGET;
+	InComment = false;
+
+	if (seek_instruction() && current() != '\0')
 	{
-		if (next() == '+') step();
+		d->Position = -1;
+		d->Kind = INS_NONE;
+		Decoding = d;
+
+		Speculating = true;
+		SpeculationFailed = false;
+		do_instruction();
+		Speculating = false;
+
+		if (!SpeculationFailed && (d->Kind & DEC_INSTRUCTION) != INS_NONE) d->Position = pos;
 	}
 
-	else if (current() == '-')
+	ProgramPosition = position;
+}
+
+// uses idle time between ticks to decode the next step's instruction, then where it leads (both ways for a conditional),
+// one instruction a pass
+void predecode_task(void)
+{
+	if (PredecodeFrom != ProgramPosition)
 	{
-		if (next() == '-') step();
+		PredecodeFrom = ProgramPosition;
+		PredecodeStage = 0;
 	}
 
-	else if (current() == '=')
+	DECODED* d = &DecodeCache[(uint8_t) ProgramPosition % DECODE_ENTRIES];
+	bool ready = d->Position == ProgramPosition;
+
+	switch (PredecodeStage)
 	{
-		step();
-		get_expression();
+	case 0:
+		predecode(ProgramPosition);
+		break;
+	case 1:
+		if (ready) predecode(d->Next);
+		break;
+	case 2:
+		if (ready && (d->Kind & DEC_INSTRUCTION) == INS_CONDITIONAL) predecode(d->Extra);
+		break;
+	default:
+		return;
 	}
+
+	PredecodeStage++;
 }
 
-// handles conditionals
-void do_conditional(void)
+// steps the Turing Machine, returns false if end of program, wait or the step carries on next pass
+bool StepTuring(void)
 {
-	bool test;
+	// a step changes the state being saved
+	CheckpointRow = -1;
 
-	if (next() == '!')
-	{
-		step();
-		int16_t x = get_expression();
-		if (x == ERROR) return;
-		test = x == 0;
-	}
+	StepBudget = STEP_BUDGET;
 
-	else if (current() == '>')
+	#if defined(OPCODE_STATS)
+	stamp();
+	#endif
+
+	if (StepState == STEP_IDLE)
 	{
-		if (next() == '=')
+		// if halted
+		if (WaitPeriods < 0) return false;
+
+		if (WaitPeriods > 0)
 		{
-			step();
-			int16_t x = get_expression();
-			if (x == ERROR) return;
-			test = x >= 0;
+			WaitPeriods--;
+			return false;
+		}
+
+		if (ProgramLength == 0)
+		{
+			StopTuring();
+			return false;
+		}
+
+		if (ProgramPosition >= ProgramLength)
+		{
+			StopTuring();
+			return false;
+		}
+
+		#if defined(OPCODE_STATS)
+		StepCycles = 0;
+		#endif
+
+		TraceSymbol = NO_SYMBOL;
+		TraceVariable = NO_NAME;
+
+		// an instruction already decoded runs without parsing its text again
+		StepStart = ProgramPosition;
+		Decoding = &DecodeCache[(uint8_t) StepStart % DECODE_ENTRIES];
+		if (Decoding->Position == StepStart)
+		{
+			#if defined(OPCODE_STATS)
+			StepKind = Decoding->Kind & DEC_INSTRUCTION;
+			#endif
+			do_decoded(Decoding);
 		}
 		else
 		{
-			int16_t x = get_expression();
-			if (x == ERROR) return;
-			test = x > 0;
+			InComment = false;
+			StepState = STEP_SEEK;
 		}
 	}
 
-	else if (current() == '<')
+	if (StepState == STEP_SEEK)
 	{
-		if (next() == '=')
+		// a long stretch of comments carries on next pass
+		if (!seek_instruction())
 		{
-			step();
-			int16_t x = get_expression();
-			if (x == ERROR) return;
-			test = x <= 0;
+			#if defined(OPCODE_STATS)
+			StepCycles += cycles_since();
+			#endif
+			return false;
 		}
-		else
+
+		if (current() == '\0')
 		{
-			int16_t x = get_expression();
-			if (x == ERROR) return;
-			test = x < 0;
+			StepState = STEP_IDLE;
+			StopTuring();
+			return false;
 		}
+
+		// decode into the entry while executing, keeping it only if the instruction completes
+		Decoding->Position = -1;
+		Decoding->Kind = INS_NONE;
+		StepState = STEP_DECODE;
+		#if defined(OPCODE_STATS)
+		StepKind = char_class(current()) & CC_INSTRUCTION;
+		#endif
+		do_instruction();
 	}
 
-	else
+	else if (StepState == STEP_LABEL)
 	{
-		int16_t x = get_expression();
-		if (x == ERROR) return;
-		test = x != 0;
+		find_label();
 	}
 
-	if (!test)
+	// a branch to a label not yet found carries on searching next pass
+	if (StepState == STEP_LABEL)
 	{
-		skip_space();
-		skip_instruction();
+		#if defined(OPCODE_STATS)
+		StepCycles += cycles_since();
+		#endif
+		return false;
+	}
+
+	if (StepState == STEP_DECODE && (Decoding->Kind & DEC_INSTRUCTION) != INS_NONE) Decoding->Position = StepStart;
+	StepState = STEP_IDLE;
+
+	#if defined(OPCODE_STATS)
+	// a conditional that fails its test carries on past the instruction it guards
+	if (StepKind == INS_CONDITIONAL && ProgramPosition == Decoding->Extra) StepKind = OP_CONDITIONAL_SKIPPED;
+	count_cycles(StepKind, StepCycles + cycles_since());
+	#endif
+
+	// the strip is refreshed by the display task, once for however many steps run before it
+	DisplayDue = true;
+
+	#if defined(TRACE)
+	trace_step(StepStart);
+	#endif
+
+	if (Settings.CycleDetection) cycle_task();
+
+	// breakpoints and watchpoints stop the machine at full speed
+	if (DebugArmed) debug_task();
+
+	if (WaitPeriods > 0)
+	{
+		WaitPeriods--;
+		return false;
 	}
+
+	return true;
 }
 
-void skip_conditional(void)
+// runs a batch of steps back to back until a tick passes, so the main loop still sees to USB every millisecond
+void batch_task(void)
 {
-	if (next() == '!')
+	uint16_t now = get_ticks();
+	bool ticked = now != BatchPrevTicks;
+	BatchTicks += (uint16_t) (now - BatchPrevTicks);
+	BatchPrevTicks = now;
+
+	do
 	{
-		step();
+		if (StepState == STEP_IDLE)
+		{
+			if (!TimerEnabled || WaitPeriods < 0)
+			{
+				end_batch(BATCH_HALTED);
+				return;
+			}
+			if (BatchLimit != 0 && BatchSteps == BatchLimit)
+			{
+				end_batch(BATCH_STEPS);
+				return;
+			}
+			if (WaitPeriods > 0)
+			{
+				if (BatchFlags & RUN_COLLAPSE_WAITS) WaitPeriods = 0;
+				else
+				{
+					// a wait period takes a tick of its own, as it does running from the timer, and isn't a step
+					if (ticked) WaitPeriods--;
+					return;
+				}
+			}
+		}
+
+		// a step out of budget carries on round the loop
+		StepTuring();
+		if (StepState != STEP_IDLE) continue;
+
+		BatchSteps++;
+		if (ProgramPosition == BatchStop)
+		{
+			end_batch(BATCH_POSITION);
+			return;
+		}
 	}
-	else if (current() == '>')
+	while (get_ticks() == BatchPrevTicks);
+}
+
+void TuringExec(void)
+{
+	// a batch run takes over from the timer
+	if (Batching)
 	{
-		if (next() == '=') step();
+		Stepping = true;
+		batch_task();
+		Stepping = false;
+		return;
 	}
-	else if (current() == '<')
+
+	// a step that ran out of budget carries on each pass, whether or not the machine is running
+	if (StepState != STEP_IDLE)
 	{
-		if (next() == '=') step();
+		Stepping = true;
+		StepTuring();
+		Stepping = false;
+		return;
 	}
-	get_expression();
 
-	skip_space();
-	skip_instruction();
+	// idle time between ticks decodes what the next step needs, so the tick only has to run it
+	uint16_t now = get_ticks();
+	if (PrevTicks == now)
+	{
+		if (TimerEnabled && WaitPeriods >= 0 && CheckpointRow < 0) predecode_task();
+		return;
+	}
+	PrevTicks = now;
+
+	// a checkpoint writes a row a tick and the machine waits for it to finish
+	if (CheckpointRow >= 0)
+	{
+		checkpoint_task();
+		return;
+	}
+
+	// checkpoints are taken after so many seconds of running time
+	if (TimerEnabled && Settings.CheckpointInterval != 0 && ++CheckpointMs >= 1000)
+	{
+		CheckpointMs = 0;
+		if (++CheckpointSecs >= Settings.CheckpointInterval && CheckpointSecs >= CHECKPOINT_MIN) start_checkpoint();
+	}
+
+	if (!TimerEnabled || --TimerCnt != 0) return;
+	TimerCnt = step_period();
+
+	uint16_t start = micros();
+	Stepping = true;
+	StepTuring();
+	Stepping = false;
+	uint16_t time = micros() - start;
+	if (time > MaxStepTime) MaxStepTime = time;
 }
 
-// handles branches
-void do_branch(void)
+// shows the tape on the LED strip when steps have changed it
+void DisplayExec(void)
 {
-	static char label[NAME_LEN+1];
+	if (!DisplayDue) return;
+	DisplayDue = false;
 
-	step();
-	copy_str(get_name(), label);
+	#if defined(OPCODE_STATS)
+	stamp();
+	#endif
 
-	ProgramPosition = 0;
-	while (true)
-	{
-		if (current() == '\0')
-		{
-			error(ERR_LABEL_NOT_FOUND);
-			return;
-		}
+	update_tape();
 
-		skip_space();
+	#if defined(OPCODE_STATS)
+	count_cycles(OP_REFRESH, cycles_since());
+	#endif
+}
 
-		if (current() != '#')
-		{
-			step();
-			continue;
-		}
-		step();
-		if (cmp_strs(get_name(), label)) return;
-	}
+// returns true if there is nothing to do until the next tick
+bool TuringWaiting(void)
+{
+	if (Batching || DisplayDue || StepState != STEP_IDLE || StoreState != STORE_IDLE || PrevTicks != get_ticks()) return false;
+
+	// the next step is decoded first
+	if (TimerEnabled && WaitPeriods >= 0 && CheckpointRow < 0)
+		return PredecodeFrom == ProgramPosition && PredecodeStage > 2;
+
+	return true;
 }
 
-void skip_branch(void)
+// returns true if there is nothing to do until a command or the button, stopped or halted
+bool TuringHalted(void)
 {
-	step();
-	get_name();
+	if (Batching || DisplayDue || StepState != STEP_IDLE || StoreState != STORE_IDLE || CheckpointRow >= 0 || SlotDirty) return false;
+
+	return !TimerEnabled || WaitPeriods < 0;
 }
 
-// handles waits
-void do_wait(void)
+// writes the program row being loaded to flash, returns false if the store is full
+bool flush_load_row(void)
 {
-	WaitPeriods = 1;
-	if (is_expression(next()))
+	if (LoadRowIndex < 0) return true;
+
+	uint8_t ndx = (uint8_t) LoadRowIndex;
+	LoadRowIndex = -1;
+
+	uint8_t row = store_row(AREA_PROGRAM + Settings.ActiveSlot, ndx, ProgramRows[ndx], LoadRow);
+	if (row == NO_ROW)
 	{
-		int16_t n = get_expression();
-		if (n == ERROR) return;
-		WaitPeriods = (int8_t) n;
-		if (WaitPeriods == 0) WaitPeriods = -1;
+		LoadFailed = true;
+		error(ERR_STORE_FULL);
+		return false;
 	}
+
+	ProgramRows[ndx] = row;
+	return true;
 }
 
-void skip_wait(void)
+// makes the program row at the load position the one being loaded
+void open_load_row(void)
 {
-	if (is_expression(next())) get_expression();
+	int8_t ndx = (int8_t) (ProgramPosition / ROW_SIZE);
+	if (ndx == LoadRowIndex) return;
+
+	flush_load_row();
+
+	// start from the stored row so an unchanged program rewrites nothing
+	LoadOpen = true;
+	if (ProgramRows[ndx] != NO_ROW) read_mem(row_address(ProgramRows[ndx]), ROW_SIZE, LoadRow);
+	else for (uint8_t i = 0; i < ROW_SIZE; i++) LoadRow[i] = 0xff;
+	LoadRowIndex = ndx;
 }
 
-// handles R, G, B, C, M, Y, W, K
-void do_set(void)
+// writes a character at the load position
+void put_load_char(char c)
 {
-	char symbol = current();
-	step();
-	// off-tape squares can't be set
-	if (HeadPosition < 0 || HeadPosition >= NUM_SQUARES) return;
-	Symbols[HeadPosition] = symbol;
+	if (ProgramPosition >= MAX_PROGRAM) return;
+
+	open_load_row();
+	LoadRow[ProgramPosition % ROW_SIZE] = (uint8_t) c;
+	ProgramPosition++;
+	if (ProgramPosition % ROW_SIZE == 0) flush_load_row();
 }
 
-void skip_set(void)
+// returns a character of the program loaded so far, fed with position
+char loaded_char(uint16_t pos)
 {
-	step();
+	if (pos >= (uint16_t) ProgramPosition) return '\0';
+
+	uint8_t row = (uint8_t) (pos / ROW_SIZE);
+	if (row == LoadRowIndex) return (char) LoadRow[pos % ROW_SIZE];
+
+	char c;
+	read_mem(row_address(ProgramRows[row]) + pos % ROW_SIZE, 1, (uint8_t*) &c);
+	return c;
 }
 
-// handles the next instruction
-void do_instruction(void)
+// returns the token the load has interned a name as, fed with name length, or 0 if none
+char find_token(int8_t len)
 {
-	if (current() == '<' || current() == '>')
-	{
-		do_movement();
-	}
+	uint8_t token = TOKEN_BASE;
 
-	else if (current() == '$')
+	// tokens first appear in order, each followed by its name
+	for (uint16_t pos = 0; token < TOKEN_BASE + LoadTokens && pos < (uint16_t) ProgramPosition; pos++)
 	{
-		do_assignment();
-	}
+		if ((uint8_t) loaded_char(pos) != token) continue;
 
-	else if (current() == '?')
-	{
-		do_conditional();
-	}
+		int8_t i;
+		for (i = 0; i < len; i++) if (loaded_char(pos + 1 + (uint8_t) i) != LoadName[i]) break;
+		if (i == len && !is_name(loaded_char(pos + 1 + (uint8_t) i))) return (char) token;
 
-	else if (current() == '^')
-	{
-		do_branch();
+		token++;
 	}
 
-	else if (current() == '%')
-	{
-		do_wait();
-	}
+	return 0;
+}
 
-	else if (is_symbol(current()))
-	{
-		do_set();
-	}
-	else
+// writes the name being loaded, as its token if already interned, otherwise interning it
+void end_name(void)
+{
+	int8_t len = LoadNameLen;
+	LoadNameLen = -1;
+	if (len <= 0) return;
+
+	// single character names gain nothing from a token
+	if (len > 1)
 	{
-		error(ERR_INSTRUCTION_ERROR);
+		char token = find_token(len);
+		if (token != 0)
+		{
+			put_load_char(token);
+			return;
+		}
+
+		if (LoadTokens < MAX_TOKENS) put_load_char((char) (TOKEN_BASE + LoadTokens++));
 	}
+
+	for (int8_t i = 0; i < len; i++) put_load_char(LoadName[i]);
 }
 
-// skips over the next instruction
-void skip_instruction(void)
+// loads a program character, names following #, ^ and $ are interned
+void load_char(char c)
 {
-	if (current() == '<' || current() == '>')
+	// comments pass through untouched to the end of the line
+	if (LoadComment)
 	{
-		skip_movement();
+		put_load_char(c);
+		if (c == '\n') LoadComment = false;
+		return;
 	}
 
-	else if (current() == '$')
+	if (is_name(c))
 	{
-		skip_assignment();
-	}
+		if (LoadNameLen < 0)
+		{
+			put_load_char(c);
+			return;
+		}
 
-	else if (current() == '?')
-	{
-		skip_conditional();
-	}
+		if (LoadNameLen < NAME_LEN-1)
+		{
+			LoadName[LoadNameLen++] = c;
+			return;
+		}
 
-	else if (current() == '^')
-	{
-		skip_branch();
+		// names that might be cut short by get_name() are left as they are
+		for (int8_t i = 0; i < LoadNameLen; i++) put_load_char(LoadName[i]);
+		LoadNameLen = -1;
+		put_load_char(c);
+		return;
 	}
 
-	else if (current() == '%')
+	// get_name() skips spaces and comments before a name, so the name is still to come
+	if (LoadNameLen == 0 && (c == ';' || char_class(c) & CC_SPACE))
 	{
-		skip_wait();
+		put_load_char(c);
+		LoadComment = c == ';';
+		return;
 	}
 
-	else if (is_symbol(current()))
-	{
-		skip_set();
-	}
+	end_name();
+	put_load_char(c);
+
+	if (c == ';') LoadComment = true;
+	else if (c == '#' || c == '^' || c == '$') LoadNameLen = 0;
 }
 
+// terminates the program loaded so far
+void terminate_load(void)
+{
+	open_load_row();
+	LoadRow[ProgramPosition % ROW_SIZE] = '\0';
 
-//**************************************************************************
-// executive functions
-//**************************************************************************
+	ProgramLength = (uint16_t) ProgramPosition;
+	flush_cache();
 
-void StartTuring(void)
-{
-	TimerCnt = 1000 / Settings.ClockSpeed;
-	TimerEnabled = true;
+	// label positions belong to the old program, as does a step in progress
+	NamesUsed = 0;
+	StepState = STEP_IDLE;
 }
 
-void StopTuring(void)
+// drops the rows past the end of program, released once the load is committed
+void trim_rows(void)
 {
-	TimerEnabled = false;
+	for (uint8_t i = (uint8_t) (ProgramLength / ROW_SIZE + 1); i < PROGRAM_ROWS; i++)
+	{
+		if (ProgramRows[i] == NO_ROW) continue;
+		mark_stale(ProgramRows[i]);
+		ProgramRows[i] = NO_ROW;
+		LoadChanged = true;
+	}
 }
 
-// resets the Turing Machine
-void ResetTuring(void)
+// commits the load by writing the program directory last, with the active slot's generation and length, or if a
+// row failed to reach flash goes back to the slot's last committed program, returns false if the load is lost
+bool commit_program(void)
 {
-	StopTuring();
+	PROGRAM_DIRECTORY* directory = (PROGRAM_DIRECTORY*) LoadRow;
+	uint8_t slot = Settings.ActiveSlot;
 
-	// leftmost square
-	HeadPosition = 0;
+	LoadOpen = false;
 
-	// start of program
-	ProgramPosition = 0;
+	if (!LoadFailed)
+	{
+		// the directory is staged in the load row, which the load has finished with
+		if (DirectoryRow != NO_ROW) read_mem(row_address(DirectoryRow), ROW_SIZE, LoadRow);
+		else for (uint8_t i = 0; i < ROW_SIZE; i++) LoadRow[i] = 0xff;
 
-	// no wait
-	WaitPeriods = 0;
+		// every row the load wrote is numbered up to the sequence number now
+		if (LoadChanged) directory->Generations[slot] = Sequence;
+		directory->Lengths[slot] = ProgramLength;
+		LoadChanged = false;
 
-	// reset timer
-	TimerCnt = 1000 / Settings.ClockSpeed;
+		uint8_t row = store_row(AREA_DIRECTORY, 0, DirectoryRow, LoadRow);
+		if (row != NO_ROW)
+		{
+			// the rows the load replaced are erased in the background
+			for (uint8_t i = 0; i < sizeof(StaleRows); i++) ObsoleteRows[i] |= StaleRows[i], StaleRows[i] = 0;
+			DirectoryRow = row;
+			return true;
+		}
 
-	// clear symbols
-	for (uint8_t i = 0; i < NUM_SQUARES; i++) Symbols[i] = 'K';
+		error(ERR_STORE_FULL);
+	}
 
-	// clear variables
-	for (uint8_t i = 0; i < MAX_VARIABLES; i++) VariableNames[i][0] = '\0';
+	// remounting releases the rows the load wrote and maps the ones it replaced again
+	LoadFailed = false;
+	LoadChanged = false;
+	mount_store(slot, false);
+	program_length();
 
-	// update LEDs
-	update_tape();
+	return false;
 }
 
-// steps the Turing Machine, returns false if end of program or wait
-bool StepTuring(void)
+// finishes a load, writing the last row and committing it
+void end_load(void)
 {
-	// if halted
-	if (WaitPeriods < 0) return false;
+	if (!LoadOpen) return;
 
-	if (WaitPeriods > 0)
+	if (LoadRowIndex >= 0)
 	{
-		WaitPeriods--;
-		return false;
+		end_name();
+		terminate_load();
+		flush_load_row();
 	}
+	trim_rows();
 
-	if (*Program == '\0')
-	{
-		StopTuring();
-		return false;
-	}
+	// checkpoints of the old program no longer apply
+	if (commit_program()) discard_checkpoints();
+}
+
+// stores the settings (staged in the load row, which is free outside a load), or only the active slot over the
+// settings stored last so any the host has changed since stay unsaved, returns false if the store is full
+bool store_settings(bool all)
+{
+	// with no settings stored the rest read as erased, which power-up replaces with defaults
+	if (!all && SettingsRow != NO_ROW) read_mem(row_address(SettingsRow), ROW_SIZE, LoadRow);
+	else for (uint8_t i = 0; i < ROW_SIZE; i++) LoadRow[i] = all && i < sizeof(Settings) ? ((uint8_t*) &Settings)[i] : 0xff;
 
-	if (ProgramPosition >= ProgramLength)
+	LoadRow[&Settings.ActiveSlot - (uint8_t*) &Settings] = Settings.ActiveSlot;
+	SlotDirty = false;
+
+	uint8_t row = store_row(AREA_SETTINGS, 0, SettingsRow, LoadRow);
+	if (row == NO_ROW)
 	{
-		StopTuring();
+		error(ERR_STORE_FULL);
 		return false;
 	}
 
-	// step over whitespace and labels
-	while (true)
+	SettingsRow = row;
+	return true;
+}
+
+// starts a background store, run a row a pass by StoreExec()
+void start_store(void)
+{
+	StoreState = STORE_LOAD;
+	StoreOk = true;
+}
+
+// runs the background store, erasing or writing at most one row a main loop pass (a load that failed goes back to
+// the last committed program at once), and reports the outcome and a CRC of the program and settings read back
+void StoreExec(void)
+{
+	uint8_t reply[3];
+
+	// rows are staged in the load row and a load moves the end of program, so the store waits for a load to end
+	if (StoreState != STORE_LOAD && LoadRowIndex >= 0) return;
+
+	// a slot chosen on the device is remembered once the choice has settled, otherwise rows no longer needed are
+	// erased while a load isn't holding on to the rows it replaced
+	if (StoreState == STORE_IDLE)
 	{
-		skip_space();
-		if (current() != '#') break;
-		step();
-		while (is_name(current())) step();
+		if (SlotDirty && (uint16_t) (get_ticks() - SlotTicks) >= SLOT_SETTLE)
+		{
+			if (ready_row()) store_settings(false);
+		}
+		else if (!LoadOpen) reclaim_row();
+		return;
 	}
 
-	if (current() == '\0')
+	// a pass that writes a row first makes sure a row is erased, taking a pass of its own if not
+	if (StoreState != STORE_VERIFY && !ready_row()) return;
+
+	switch (StoreState)
 	{
-		StopTuring();
-		return false;
+	case STORE_LOAD:
+		// the last row of a load is still waiting to be written
+		StoreEndsLoad = LoadOpen;
+		if (LoadRowIndex >= 0) end_name(), terminate_load();
+		if (!flush_load_row()) StoreOk = false;
+		StoreState = StoreEndsLoad ? STORE_COMMIT : STORE_SETTINGS;
+		break;
+
+	case STORE_COMMIT:
+		// a command may have ended the load meanwhile
+		if (LoadOpen)
+		{
+			trim_rows();
+			if (commit_program()) discard_checkpoints();
+			else StoreOk = false;
+		}
+		StoreState = STORE_SETTINGS;
+		break;
+
+	case STORE_SETTINGS:
+		if (!store_settings(true)) StoreOk = false;
+		StoreRow = 0;
+		StoreCrc = 0xff;
+		StoreState = STORE_VERIFY;
+		break;
+
+	case STORE_VERIFY:
+		// the program a row a pass, then the settings
+		if ((uint16_t) StoreRow * ROW_SIZE < ProgramLength)
+		{
+			uint16_t left = ProgramLength - (uint16_t) StoreRow * ROW_SIZE;
+			uint8_t len = left < ROW_SIZE ? (uint8_t) left : ROW_SIZE;
+
+			if (ProgramRows[StoreRow] == NO_ROW) StoreOk = false;
+			else
+			{
+				read_mem(row_address(ProgramRows[StoreRow]), len, RowData);
+				StoreCrc = crc8(StoreCrc, RowData, len);
+			}
+
+			StoreRow++;
+			break;
+		}
+
+		if (SettingsRow == NO_ROW) StoreOk = false;
+		else
+		{
+			read_mem(row_address(SettingsRow), sizeof(Settings), RowData);
+			StoreCrc = crc8(StoreCrc, RowData, sizeof(Settings));
+		}
+
+		reply[0] = STORE;
+		reply[1] = StoreOk ? 0 : ERR_STORE_FULL;
+		reply[2] = StoreCrc;
+		StoreState = STORE_IDLE;
+		SendReply(reply, 3);
+		break;
 	}
+}
 
-	do_instruction();
+// finds the length of the mounted program, erased flash reads as 0xff
+void program_length(void)
+{
+	flush_cache();
 
-	update_tape();
+	ProgramLength = 0;
+	for (uint8_t i = 0; i < PROGRAM_ROWS; i++)
+	{
+		if (ProgramRows[i] == NO_ROW) return;
+		read_mem(row_address(ProgramRows[i]), ROW_SIZE, RowData);
 
-	if (WaitPeriods > 0)
+		for (uint8_t j = 0; j < ROW_SIZE; j++)
+		{
+			if (RowData[j] == '\0' || RowData[j] == 0xff || ProgramLength >= MAX_PROGRAM) return;
+			ProgramLength++;
+		}
+	}
+}
+
+void error(int err)
+{
+	// a speculative decode gives up rather than stopping the machine
+	if (Speculating)
 	{
-		WaitPeriods--;
-		return false;
+		SpeculationFailed = true;
+		return;
 	}
 
-	return true;
+	StepState = STEP_IDLE;
+	TraceError = (uint8_t) err;
+	LED_Flash((uint8_t) err);
+	StopTuring();
+	ProgramPosition = (int16_t) ProgramLength;
 }
 
-void TuringExec(void)
+// makes a program slot active and runs it
+void SelectSlot(uint8_t slot)
 {
-	if (PrevTicks == Ticks) return;
-	PrevTicks = Ticks;
+	end_load();
 
-	if (!TimerEnabled || --TimerCnt != 0) return;
-	TimerCnt = 1000 / Settings.ClockSpeed;
+	Settings.ActiveSlot = slot;
+	mount_store(slot, false);
+	program_length();
 
-	StepTuring();
+	// remember the choice across power cycles, in the background once it has settled
+	SlotDirty = true;
+	SlotTicks = get_ticks();
+
+	ResetTuring();
+	if (ProgramLength > 0) StartTuring();
 }
 
-void error(int err)
+// makes the next program slot active
+void NextSlot(void)
 {
-	while (err-- > 0) LED_Flash();
-	StopTuring();
-	ProgramPosition = (int8_t) ProgramLength;
+	SelectSlot((uint8_t) ((Settings.ActiveSlot + 1) % NUM_SLOTS));
+}
+
+#if defined(PROFILER)
+// starts profiling afresh, fed with the bucket shift (PROFILE_OFF for off) and first position profiled
+void start_profile(uint8_t shift, int16_t start)
+{
+	// a bucket can't span more than the program position's 16 bits
+	if (shift > 15 && shift != PROFILE_OFF) return;
+
+	PROFILE_Enable(false);
+	ProfileShift = PROFILE_OFF;
+
+	for (uint8_t i = 0; i < PROFILE_BUCKETS; i++) Profile[i] = 0;
+	ProfileMissed = ProfileIdle = 0;
+	ProfileStart = start;
+
+	ProfileShift = shift;
+	if (shift != PROFILE_OFF) PROFILE_Enable(true);
+}
+
+// sends the profile, the bucket shift, first position and samples missed, the bucket counts, then the samples
+// finding no step running
+void send_profile(void)
+{
+	uint8_t reply[8 + PROFILE_BUCKETS*2];
+
+	reply[0] = GET_PROFILE;
+	reply[1] = ProfileShift;
+	reply[2] = (uint8_t) ProfileStart;
+	reply[3] = (uint8_t) (ProfileStart >> 8);
+
+	// the profile timer updates the counts, so they are read in one go
+	INTCONbits.GIE = 0;
+	reply[4] = (uint8_t) ProfileMissed;
+	reply[5] = (uint8_t) (ProfileMissed >> 8);
+	for (uint8_t i = 0; i < PROFILE_BUCKETS; i++)
+	{
+		reply[6 + i*2] = (uint8_t) Profile[i];
+		reply[7 + i*2] = (uint8_t) (Profile[i] >> 8);
+	}
+	reply[6 + PROFILE_BUCKETS*2] = (uint8_t) ProfileIdle;
+	reply[7 + PROFILE_BUCKETS*2] = (uint8_t) (ProfileIdle >> 8);
+	INTCONbits.GIE = 1;
+
+	SendReply(reply, sizeof(reply));
 }
+#endif
 
 // processes USB commands, fed with buffer pointer and character count
 void ProcessCommand(uint8_t* buffer, uint8_t cnt)
 {
-	// commands
-	enum {RESET = 1, LOAD, RUN, STEP, SET_SPEED, SET_HIGHLIGHT, STORE};
+	uint8_t reply[28];
+	reply[0] = buffer[0];
+
+	// a load ends with the first command that isn't a load, a store ends it in the background
+	if (buffer[0] != LOAD && buffer[0] != STORE) end_load();
 
 	switch (buffer[0])
 	{
@@ -1001,12 +3558,14 @@ void ProcessCommand(uint8_t* buffer, uint8_t cnt)
 		break;
 
 	case LOAD:
-		for (int8_t i = 1; i < cnt; i++)
-		{
-			if (ProgramPosition < MAX_PROGRAM) Program[ProgramPosition++] = buffer[i];
-		}
-		Program[ProgramPosition] = '\0';
-		ProgramLength = str_len(Program);
+		// a load starts with no names interned
+		if (ProgramPosition == 0) LoadTokens = 0, LoadNameLen = -1, LoadComment = false;
+
+		// program goes to flash a row at a time, the last row waits for the end of the load
+		for (uint8_t i = 1; i < cnt; i++) load_char((char) buffer[i]);
+
+		// a name split across loads is written when it ends
+		terminate_load();
 		break;
 
 	case RUN:
@@ -1020,7 +3579,7 @@ void ProcessCommand(uint8_t* buffer, uint8_t cnt)
 		break;
 
 	case SET_SPEED:
-		if (cnt > 1) Settings.ClockSpeed = buffer[1], TimerCnt = 1000 / Settings.ClockSpeed;
+		if (cnt > 1) Settings.ClockSpeed = buffer[1], TimerCnt = step_period();
 		break;
 
 	case SET_HIGHLIGHT:
@@ -1028,29 +3587,223 @@ void ProcessCommand(uint8_t* buffer, uint8_t cnt)
 		break;
 
 	case STORE:
-		write_mem(SETTINGS_BASE, sizeof(Settings), (uint8_t*) &Settings);
-		write_mem(PROGRAM_BASE, sizeof(Program), (uint8_t*) Program);
-		LED_Flash();
+		// program is stored as it loads, so only the end of the load and the settings are left
+		start_store();
+		break;
+
+	case PING:
+		// echo the host's timestamp followed by our own
+		{
+			uint8_t n = 1;
+			for (uint8_t i = 1; i < cnt && n < sizeof(reply)-2; i++) reply[n++] = buffer[i];
+			uint16_t ticks = get_ticks();
+			reply[n++] = (uint8_t) ticks;
+			reply[n++] = (uint8_t) (ticks >> 8);
+			SendReply(reply, n);
+		}
+		break;
+
+	case GET_INFO:
+		reply[1] = FIRMWARE_VERSION;
+		reply[2] = (uint8_t) CAPABILITIES;
+		reply[3] = (uint8_t) (CAPABILITIES >> 8);
+		reply[4] = (uint8_t) MAX_PROGRAM;
+		reply[5] = (uint8_t) (MAX_PROGRAM >> 8);
+		reply[6] = NAME_ARENA;
+		reply[7] = NumLeds;
+		reply[8] = NUM_SLOTS;
+		reply[9] = (uint8_t) TAPE_MAX;
+		reply[10] = (uint8_t) (TAPE_MAX >> 8);
+		reply[11] = (uint8_t) CAPABILITIES2;
+		reply[12] = (uint8_t) (CAPABILITIES2 >> 8);
+		SendReply(reply, 13);
+		break;
+
+	case GET_STATS:
+		{
+			uint8_t variables = 0;
+			for (uint8_t i = 0; i < NamesUsed; i = next_name(i)) if (Names[i] == '$') variables++;
+
+			reply[1] = (uint8_t) LoopRate;
+			reply[2] = (uint8_t) (LoopRate >> 8);
+			reply[3] = MaxStackDepth;
+			reply[4] = ResetFlags;
+			reply[5] = (uint8_t) ProgramLength;
+			reply[6] = (uint8_t) (ProgramLength >> 8);
+			reply[7] = variables;
+			reply[8] = TimerEnabled ? 1 : 0;
+			reply[9] = (uint8_t) CacheMisses;
+			reply[10] = (uint8_t) (CacheMisses >> 8);
+			reply[11] = (uint8_t) FlashErases;
+			reply[12] = (uint8_t) (FlashErases >> 8);
+			reply[13] = (uint8_t) FlashWrites;
+			reply[14] = (uint8_t) (FlashWrites >> 8);
+			reply[15] = Settings.ActiveSlot;
+			reply[16] = (uint8_t) BootTicks;
+			reply[17] = (uint8_t) (BootTicks >> 8);
+			reply[18] = (uint8_t) FrameTime;
+			reply[19] = (uint8_t) (FrameTime >> 8);
+			reply[20] = (uint8_t) MaxStepTime;
+			reply[21] = (uint8_t) (MaxStepTime >> 8);
+			reply[22] = (uint8_t) CycleLength;
+			reply[23] = (uint8_t) (CycleLength >> 8);
+			reply[24] = (uint8_t) IdleRate;
+			reply[25] = (uint8_t) (IdleRate >> 8);
+			reply[26] = (uint8_t) Sleeps;
+			reply[27] = (uint8_t) (Sleeps >> 8);
+			SendReply(reply, 28);
+		}
+		break;
+
+	case SELECT_SLOT:
+		// following loads go to this slot
+		if (cnt > 1 && buffer[1] < NUM_SLOTS) SelectSlot(buffer[1]);
+		break;
+
+	case SET_FAST_START:
+		if (cnt > 1) Settings.FastStart = buffer[1] != 0;
+		break;
+
+	case SET_CHECKPOINT:
+		// seconds between checkpoints, 0 for none (shorter than CHECKPOINT_MIN runs at the minimum)
+		if (cnt > 1) Settings.CheckpointInterval = buffer[1], CheckpointMs = 0, CheckpointSecs = 0;
+		break;
+
+	case CHECKPOINT:
+		start_checkpoint();
+		break;
+
+	case SET_TAPE:
+		// virtual tape length, little endian
+		if (cnt > 2)
+		{
+			uint16_t length = buffer[1] | (uint16_t) buffer[2] << 8;
+			if (length > 0 && length <= TAPE_MAX) set_tape_length(length), update_tape();
+		}
+		break;
+
+	case SET_STRIP:
+		// LEDs in the strip, a tape shorter than the strip grows to fill it
+		if (cnt > 1 && buffer[1] > 0 && buffer[1] <= STRIP_MAX)
+		{
+			Settings.StripLength = NumLeds = buffer[1];
+			if (Settings.TapeLength < NumLeds) set_tape_length(NumLeds);
+			update_tape();
+		}
+		break;
+
+	case SET_CYCLE_DETECT:
+		// park programs found cycling without waits
+		if (cnt > 1) Settings.CycleDetection = buffer[1] != 0, reset_cycle();
+		break;
+
+	case RUN_STEPS:
+		// steps to run (0 for no limit) and program position to stop at (0xffff for none), little endian, then options
+		if (cnt > 5) start_batch(buffer[1] | (uint16_t) buffer[2] << 8, (int16_t) (buffer[3] | (uint16_t) buffer[4] << 8), buffer[5]);
+		break;
+
+	#if defined(PROFILER)
+	case SET_PROFILE:
+		// bucket shift (0xff for off) then the first position profiled, little endian
+		if (cnt > 3) start_profile(buffer[1], (int16_t) (buffer[2] | (uint16_t) buffer[3] << 8));
+		break;
+
+	case GET_PROFILE:
+		send_profile();
+		break;
+	#endif
+
+	#if defined(OPCODE_STATS)
+	case GET_OPCODE_STATS:
+		// instruction kind, 0xff clears them all
+		if (cnt > 1) send_opcode_stats(buffer[1]);
+		break;
+	#endif
+
+	#if defined(TRACE)
+	case GET_TRACE:
+		send_trace();
+		break;
+	#endif
+
+	case SET_BREAKPOINT:
+		// breakpoint number then the program position, little endian (0xffff clears it)
+		if (cnt > 3 && buffer[1] < NUM_BREAKPOINTS)
+		{
+			Breakpoints[buffer[1]] = (int16_t) (buffer[2] | (uint16_t) buffer[3] << 8);
+			arm_debug();
+		}
+		break;
+
+	case SET_WATCH:
+		// a variable's name or a tape square (little endian), nothing to stop watching
+		if (cnt > 1 && buffer[1] == WATCH_VARIABLE) watch_variable(&buffer[2], cnt - 2);
+		else if (cnt > 1 && buffer[1] == WATCH_SQUARE) watch_square(cnt > 3 ? (int16_t) (buffer[2] | (uint16_t) buffer[3] << 8) : -1);
+		break;
+
+	case CONTINUE:
+		// runs on from where the machine stopped
+		StartTuring();
+		break;
+
+	case GET_CPU:
+		// the percentage of the time each part has taken since the last time asked
+		CPU_Report(&reply[1]);
+		SendReply(reply, 1 + CPU_BUCKETS);
+		break;
+
+	case GET_TASKS:
+		// the number of tasks then each one's missed deadlines, worst lateness and longest run since the last time asked
+		reply[1] = TaskStats(&reply[2]);
+		SendReply(reply, 2 + 4 * reply[1]);
 		break;
 	}
 }
 
 void InitTuring(void)
 {
-	read_mem(SETTINGS_BASE, sizeof(Settings), (uint8_t*) &Settings);
-	read_mem(PROGRAM_BASE, sizeof(Program), (uint8_t*) Program);
+	mount_store(0, true);
+
+	if (SettingsRow != NO_ROW) read_mem(row_address(SettingsRow), sizeof(Settings), (uint8_t*) &Settings);
+
+	if (Settings.ActiveSlot >= NUM_SLOTS) Settings.ActiveSlot = 0;
+	if (Settings.ActiveSlot != 0) mount_store(Settings.ActiveSlot, false);
 
-	ProgramLength = str_len(Program);
+	program_length();
 
-	if (read_byte(SETTINGS_BASE) == 0xff || read_byte(SETTINGS_BASE) == 0)
+	if (SettingsRow == NO_ROW || Settings.ClockSpeed == 0xff || Settings.ClockSpeed == 0)
 	{
 		Settings.ClockSpeed = 1;
 		Settings.TapeheadHighlighting = true;
+		Settings.FastStart = true;
+		Settings.CheckpointInterval = 0;
+		Settings.TapeLength = NUM_SQUARES;
+		Settings.StripLength = NUM_SQUARES;
+		Settings.CycleDetection = 0;
 	}
 
-	if (read_byte(PROGRAM_BASE) != 0xff && read_byte(PROGRAM_BASE) != 0)
+	// settings stored before checkpoints existed
+	if (Settings.CheckpointInterval == 0xff) Settings.CheckpointInterval = 0;
+	if (Settings.TapeLength == 0 || Settings.TapeLength > TAPE_MAX) Settings.TapeLength = NUM_SQUARES;
+	if (Settings.StripLength == 0 || Settings.StripLength > STRIP_MAX) Settings.StripLength = NUM_SQUARES;
+	if (Settings.CycleDetection == 0xff) Settings.CycleDetection = 0;
+	NumLeds = Settings.StripLength;
+
+	// the self test is skipped when a stored program can start straight away
+	if (ProgramLength == 0 || !Settings.FastStart) test_leds();
+
+	if (ProgramLength > 0)
 	{
-		ResetTuring();
-		StartTuring();
+		// carry on from the last checkpoint, otherwise start afresh
+		if (!resume_checkpoint())
+		{
+			ResetTuring();
+			StartTuring();
+		}
+
+		// first step on the next tick
+		TimerCnt = 1;
 	}
+
+	BootTicks = get_ticks();
 }
@@ -7,7 +7,7 @@
 
 void APP_LEDUpdateUSBStatus(void);
 void APP_DeviceCDCEmulatorInitialize(void);
-void LED_Flash(void);
+void LED_Flash(uint8_t n);
 
 
 bool USER_USB_CALLBACK_EVENT_HANDLER(USB_EVENT event, void *pdata, uint16_t size)
@@ -37,8 +37,7 @@ bool USER_USB_CALLBACK_EVENT_HANDLER(USB_EVENT event, void *pdata, uint16_t size
 		APP_DeviceCDCEmulatorInitialize();
 
 		// double flash LED
-		LED_Flash();
-		LED_Flash();
+		LED_Flash(2);
 
 		break;
 
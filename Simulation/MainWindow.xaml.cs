@@ -16,7 +16,8 @@ namespace TuringMachine
 	public enum Symbol {RED, GREEN, BLUE, CYAN, MAGENTA, YELLOW, WHITE, BLACK};
 
 	// commands
-	public enum Command {RESET = 1, LOAD, RUN, STEP, SET_SPEED, SET_HIGHLIGHT, STORE};
+	public enum Command {RESET = 1, LOAD, RUN, STEP, SET_SPEED, SET_HIGHLIGHT, STORE, PING, GET_INFO, GET_STATS, SELECT_SLOT, SET_FAST_START, SET_CHECKPOINT, CHECKPOINT, SET_TAPE, SET_STRIP, SET_CYCLE_DETECT, RUN_STEPS, SET_PROFILE, GET_PROFILE, GET_OPCODE_STATS, GET_TRACE,
+		SET_BREAKPOINT, SET_WATCH, CONTINUE, GET_CPU, GET_TASKS};
 
 	public static class Extensions
 	{
@@ -46,17 +47,22 @@ namespace TuringMachine
 
 		private readonly Color[] SymbolColours = new Color[] {Colors.Red, Colors.Green, Colors.Blue, Colors.Cyan, Colors.Magenta, Colors.Yellow, Colors.White, Colors.Black};
 
-		// number of squares on the tape
-		private const int NUM_SQUARES = 27;
+		// number of squares on the tape, one per LED on the strip
+		private static int NUM_SQUARES => Properties.Settings.Default.StripLength;
 
-		// maximum number of variables
-		private const int MAX_VARIABLES = 10;
+		// bytes the device has for the variables and the labels branched to, as in the firmware
+		private const int NAME_ARENA = 96;
+
+		// bytes a name takes in the arena: its kind, the name (interned as a one byte token when the program is loaded),
+		// a terminator and its value, one byte for a variable and two for a label's position
+		private static int NameBytes(bool label) => 1 + 1 + 1 + (label ? 2 : 1);
 
 		// maximum number of significant characters in label and variable names
 		private const int NAME_LEN = 10;
 
 		// maximum program length
-		private const int MAX_PROGRAM = 256;
+		private const int MAX_PROGRAM = 512;
+		private const int BENCHMARK_STEPS = 50000;
 
 		private const string WindowTitle = "Turing Snake Turing Machine";
 		private string ProgramFilename = "";
@@ -101,9 +107,18 @@ namespace TuringMachine
 		// wait periods
 		private int WaitPeriods = 0;
 
+		// cycle detection (Brent's algorithm), the machine state last saved, steps since then,
+		// the interval before saving again and whether a wait has run since
+		private string CycleState = "";
+		private int CycleSteps = 0;
+		private int CyclePower = 1;
+		private bool CycleWaited = false;
+
 		private List<Symbol> Symbols = new();
 		private List<Ellipse> LEDs = new();
 		private Dictionary<string, int> Variables = new();
+		private HashSet<string> Labels = new();
+		private int NamesUsed = 0;
 
 		public static RoutedCommand NewCommand = new();
 		public static RoutedCommand LoadCommand = new();
@@ -165,6 +180,7 @@ namespace TuringMachine
 			SyntaxHighlightingMenuItem.IsChecked = Properties.Settings.Default.SyntaxHighlighting;
 			RepeatStepMenuItem.IsChecked = Properties.Settings.Default.RepeatStep;
 			TapeheadHighlightingMenuItem.IsChecked = Properties.Settings.Default.TapeheadHighlighting;
+			CycleDetectionMenuItem.IsChecked = Properties.Settings.Default.CycleDetection;
 
 			DrawAll();
 
@@ -523,7 +539,8 @@ namespace TuringMachine
 		// update all LEDs
 		private void UpdateTape()
 		{
-			for (int i = 0; i < NUM_SQUARES; i++)
+			// the board drawn has one PCB's worth of LEDs
+			for (int i = 0; i < NUM_SQUARES && i < LEDs.Count; i++)
 			{
 				Color colour = SymbolColours[(int) Symbols[i]];
 				LEDs[i].Fill = new SolidColorBrush(colour);
@@ -752,6 +769,10 @@ namespace TuringMachine
 			for (int i = 0; i < NUM_SQUARES; i++) Symbols[i] = Symbol.BLACK;
 
 			Variables.Clear();
+			Labels.Clear();
+			NamesUsed = 0;
+
+			ResetCycle();
 
 			StartButtonIcon.Visibility = StartMenuIcon.Visibility = Visibility.Visible;
 			PauseButtonIcon.Visibility = PauseMenuIcon.Visibility = Visibility.Hidden;
@@ -811,6 +832,42 @@ namespace TuringMachine
 			}
 		}
 
+		// returns the machine state, exactly, for cycle detection
+		private string MachineState()
+		{
+			return string.Join(",", Symbols) + "/" + HeadPosition + "/" + ProgramPosition + "/" + string.Join(",", Variables);
+		}
+
+		// restarts cycle detection from the current state
+		private void ResetCycle()
+		{
+			CycleState = MachineState();
+			CycleSteps = 0;
+			CyclePower = 1;
+			CycleWaited = false;
+		}
+
+		// checks for a cycle after a step using Brent's algorithm, returns the cycle length or 0 if none found yet
+		private int CheckCycle()
+		{
+			if (WaitPeriods != 0) CycleWaited = true;
+
+			string state = MachineState();
+
+			CycleSteps++;
+			if (state == CycleState && !CycleWaited) return CycleSteps;
+
+			if (CycleSteps == CyclePower)
+			{
+				CycleState = state;
+				CycleSteps = 0;
+				CyclePower *= 2;
+				CycleWaited = false;
+			}
+
+			return 0;
+		}
+
 		// steps the Turing Machine, returns false if end of program or wait
 		private bool Step()
 		{
@@ -1075,8 +1132,12 @@ namespace TuringMachine
 				string variable = get_name();
 				if (!Variables.ContainsKey(variable))
 				{
-					if (Variables.Count >= MAX_VARIABLES) error("Too many variables");
-					else Variables.Add(variable, 0);
+					if (NamesUsed + NameBytes(false) > NAME_ARENA) error("Too many names");
+					else
+					{
+						Variables.Add(variable, 0);
+						NamesUsed += NameBytes(false);
+					}
 				}
 
 				skip_space();
@@ -1243,7 +1304,16 @@ namespace TuringMachine
 						continue;
 					}
 					step();
-					if (get_name() == label) return;
+					if (get_name() == label)
+					{
+						// the device remembers where a label is while there's room, otherwise it searches every time
+						if (!Labels.Contains(label) && NamesUsed + NameBytes(true) <= NAME_ARENA)
+						{
+							Labels.Add(label);
+							NamesUsed += NameBytes(true);
+						}
+						return;
+					}
 				}
 			}
 
@@ -1390,6 +1460,18 @@ namespace TuringMachine
 			CommandBuffer[0] = (byte) Command.STEP;
 			DevicePort.Write(CommandBuffer, 1);
 
+			// a program going round the same states without waiting is parked
+			if (Properties.Settings.Default.CycleDetection)
+			{
+				int cycle = CheckCycle();
+				if (cycle != 0)
+				{
+					Stop();
+					StatusMessage.Text = "Parked - repeats every " + cycle + " step(s)";
+					return false;
+				}
+			}
+
 			if (WaitPeriods > 0)
 			{
 				WaitPeriods--;
@@ -1673,6 +1755,14 @@ namespace TuringMachine
 			CommandBuffer[1] = Properties.Settings.Default.TapeheadHighlighting ? (byte) 1 : (byte) 0;
 			DevicePort.Write(CommandBuffer, 2);
 
+			CommandBuffer[0] = (byte) Command.SET_STRIP;
+			CommandBuffer[1] = (byte) NUM_SQUARES;
+			DevicePort.Write(CommandBuffer, 2);
+
+			CommandBuffer[0] = (byte) Command.SET_CYCLE_DETECT;
+			CommandBuffer[1] = Properties.Settings.Default.CycleDetection ? (byte) 1 : (byte) 0;
+			DevicePort.Write(CommandBuffer, 2);
+
 			Program = GetProgram();
 			string prog = RemoveComments(Program);
 			int ndx = 0, len = prog.Length;
@@ -1709,6 +1799,46 @@ namespace TuringMachine
 			DevicePort.Write(CommandBuffer, 1);
 		}
 
+		private void BenchmarkMenuItem_Click(object sender, RoutedEventArgs e)
+		{
+			if (!DevicePort.IsOpen())
+			{
+				MessageBox.Show("Virtual serial port not open", "Benchmark program", MessageBoxButton.OK, MessageBoxImage.Error);
+				return;
+			}
+
+			// runs the uploaded program flat out for a fixed number of steps, waits collapsed and LEDs held
+			CommandBuffer[0] = (byte) Command.RESET;
+			DevicePort.Write(CommandBuffer, 1);
+
+			while (DevicePort.Read(false) >= 0) ;
+
+			CommandBuffer[0] = (byte) Command.RUN_STEPS;
+			CommandBuffer[1] = (byte) (BENCHMARK_STEPS & 0xff);
+			CommandBuffer[2] = (byte) (BENCHMARK_STEPS >> 8);
+			CommandBuffer[3] = 0xff;
+			CommandBuffer[4] = 0xff;
+			CommandBuffer[5] = 0x03;
+			DevicePort.Write(CommandBuffer, 6);
+
+			// reply is the stop reason, steps run and milliseconds taken, little endian
+			byte[] reply = new byte[16];
+			DateTime start = DateTime.Now;
+			while (DevicePort.BytesToRead < reply.Length && (DateTime.Now - start).TotalSeconds < 30) System.Threading.Thread.Sleep(50);
+
+			if (DevicePort.Read(reply, reply.Length, false) < 0 || reply[0] != (byte) Command.RUN_STEPS)
+			{
+				MessageBox.Show("No reply from device", "Benchmark program", MessageBoxButton.OK, MessageBoxImage.Error);
+				return;
+			}
+
+			uint steps = BitConverter.ToUInt32(reply, 2);
+			uint ticks = BitConverter.ToUInt32(reply, 6);
+			string result = string.Format("{0} steps in {1} ms", steps, ticks);
+			if (ticks > 0) result += string.Format(" = {0:F0} steps/second", steps * 1000.0 / ticks);
+			MessageBox.Show(result, "Benchmark program", MessageBoxButton.OK, MessageBoxImage.Information);
+		}
+
 		private void ReconnectMenuItem_Click(object sender, RoutedEventArgs e)
 		{
 			DevicePort.Close();
@@ -1745,6 +1875,18 @@ namespace TuringMachine
 			Properties.Settings.Default.Save();
 		}
 
+		private void CycleDetection_Click(object sender, RoutedEventArgs e)
+		{
+			Properties.Settings.Default.CycleDetection = CycleDetectionMenuItem.IsChecked;
+			Properties.Settings.Default.Save();
+
+			ResetCycle();
+
+			CommandBuffer[0] = (byte) Command.SET_CYCLE_DETECT;
+			CommandBuffer[1] = Properties.Settings.Default.CycleDetection ? (byte) 1 : (byte) 0;
+			DevicePort.Write(CommandBuffer, 2);
+		}
+
 		private void ClockSpeed_Click(object sender, RoutedEventArgs e)
 		{
 			Properties.Settings.Default.ClockSpeed = Convert.ToInt32((e.Source as MenuItem).Tag);
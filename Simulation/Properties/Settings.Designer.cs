@@ -190,5 +190,29 @@ namespace TuringMachine.Properties {
                 this["FileHistory6"] = value;
             }
         }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("27")]
+        public int StripLength {
+            get {
+                return ((int)(this["StripLength"]));
+            }
+            set {
+                this["StripLength"] = value;
+            }
+        }
+        
+        [global::System.Configuration.UserScopedSettingAttribute()]
+        [global::System.Diagnostics.DebuggerNonUserCodeAttribute()]
+        [global::System.Configuration.DefaultSettingValueAttribute("False")]
+        public bool CycleDetection {
+            get {
+                return ((bool)(this["CycleDetection"]));
+            }
+            set {
+                this["CycleDetection"] = value;
+            }
+        }
     }
 }